@@ -1,12 +1,11 @@
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
 #include "message_slot.h"
+#include "message_slot_client.h"
 
 int main(int argc, char** argv) {
-    int fd;
+    msgslot_client_t* client;
     unsigned int channel_id;
     const char* device;
     char buffer[MAX_MESSAGE_LENGTH];
@@ -25,36 +24,43 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    fd = open(device, O_RDONLY);
-    if (fd < 0) {
+    // Non-blocking, so that an empty channel is reported instead of waited for
+    client = msgslot_client_create(MSGSLOT_NONBLOCK);
+    if (!client) {
+        perror("msgslot_client_create");
+        return 1;
+    }
+
+    if (msgslot_fd(client, device) < 0) {
         perror("open");
+        msgslot_client_destroy(client);
         return 1;
     }
 
-    if (ioctl(fd, MSG_SLOT_CHANNEL, channel_id) < 0) {
+    if (msgslot_select(client, device, channel_id) < 0) {
         perror("ioctl MSG_SLOT_CHANNEL");
-        close(fd);
+        msgslot_client_destroy(client);
         return 1;
     }
 
-    bytes_read = read(fd, buffer, MAX_MESSAGE_LENGTH);
+    bytes_read = msgslot_recv(client, device, channel_id, buffer, MAX_MESSAGE_LENGTH);
     if (bytes_read < 0) {
         perror("read");
-        close(fd);
+        msgslot_client_destroy(client);
         return 1;
     }
     if (bytes_read == 0) {
         fprintf(stderr, "Error: Channel is empty.\n");
-        close(fd);
+        msgslot_client_destroy(client);
         return 1;
     }
 
     if (write(STDOUT_FILENO, buffer, bytes_read) < 0) {
         perror("write");
-        close(fd);
+        msgslot_client_destroy(client);
         return 1;
     }
 
-    close(fd);
+    msgslot_client_destroy(client);
     return 0;
-}
\ No newline at end of file
+}
@@ -1,13 +1,11 @@
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <sys/ioctl.h>
 #include "message_slot.h"
+#include "message_slot_client.h"
 
 int main(int argc, char** argv) {
-    int fd;
+    msgslot_client_t* client;
     unsigned int channel_id;
     unsigned int censorship;
     const char* device;
@@ -28,30 +26,30 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    fd = open(device, O_WRONLY);
-    if (fd < 0) {
-        perror("open");
+    client = msgslot_client_create(0);
+    if (!client) {
+        perror("msgslot_client_create");
         return 1;
     }
 
-    if (ioctl(fd, MSG_SLOT_SET_CEN, censorship) < 0) {
-        perror("ioctl MSG_SLOT_SET_CEN");
-        close(fd);
+    if (msgslot_fd(client, device) < 0) {
+        perror("open");
+        msgslot_client_destroy(client);
         return 1;
     }
 
-    if (ioctl(fd, MSG_SLOT_CHANNEL, channel_id) < 0) {
+    if (msgslot_select(client, device, channel_id) < 0) {
         perror("ioctl MSG_SLOT_CHANNEL");
-        close(fd);
+        msgslot_client_destroy(client);
         return 1;
     }
 
-    if (write(fd, message, strlen(message)) < 0) {
+    if (msgslot_send(client, device, channel_id, censorship, message, strlen(message)) < 0) {
         perror("write");
-        close(fd);
+        msgslot_client_destroy(client);
         return 1;
     }
 
-    close(fd);
+    msgslot_client_destroy(client);
     return 0;
-}
\ No newline at end of file
+}
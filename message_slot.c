@@ -9,33 +9,2255 @@
 #include <linux/types.h>        // Basic data types
 #include <linux/errno.h>        // Error codes
 #include <linux/mutex.h>        // Mutex locking mechanisms
+#include <linux/xarray.h>       // Radix-tree based index for the channels of a slot
+#include <linux/kref.h>         // Reference counting for slots and channels
+#include <linux/spinlock.h>     // Spinlocks serializing writers of a channel
+#include <linux/rcupdate.h>     // RCU protection for lock-free lookups and reads
+#include <linux/mm.h>           // Memory mapping of the per-slot message pages
+#include <linux/vmalloc.h>      // Allocation of mmap-able per-slot message pages
+#include <linux/wait.h>         // Wait queues for blocking reads
+#include <linux/poll.h>         // poll/epoll support
+#include <linux/percpu.h>       // Per-CPU statistics counters
+#include <linux/percpu_counter.h> // Memory charged to a slot, updated on every write
+#include <linux/debugfs.h>      // Statistics files under /sys/kernel/debug/message_slot
+#include <linux/seq_file.h>     // Formatting of the statistics files
+#include <linux/ktime.h>        // Timestamps for the latency histograms
+#include <linux/idr.h>          // Allocation of mmap entries to channels
+#include <linux/workqueue.h>    // Reaper of idle channels
+#include <linux/jhash.h>        // Hashing of message payloads for deduplication
+#include <linux/hash.h>         // Folding of payload hashes into dedup buckets
+#include <linux/list_bl.h>      // Buckets of the deduplication table
+#include <linux/uio.h>          // iov_iter transfers for readv/writev and splice
+#include <linux/splice.h>       // splice()/sendfile() through the iov_iter paths
+#include <linux/io_uring/cmd.h> // io_uring commands transferring on a named channel
+#include <linux/nodemask.h>     // NUMA node validation for slot placement
+#include <linux/hrtimer.h>      // Sleeps of writers held back by a blocking rate limit
+#include <linux/sched/signal.h> // Interruption of those sleeps
 #include "message_slot.h"       // Header for message slot device specifics
 
+#define CREATE_TRACE_POINTS
+#include "message_slot_trace.h" // Tracepoints on the read, write and ioctl paths
+
 MODULE_LICENSE("GPL");
 
-// Represents a communication channel within a slot, holding a message and its length
-typedef struct channel {
-    unsigned int id;
-    char message[MAX_MESSAGE_LENGTH];
-    size_t message_length;
-    struct channel* next;
-} channel_t;
+// Number of minors claimed by register_chrdev, and thus the size of the slot table
+#define SLOT_TABLE_SIZE 256
+
+// Number of channels per slot mirrored into the slot's read-only mmap area
+static unsigned int mmap_channels = 256;
+module_param(mmap_channels, uint, 0444);
+MODULE_PARM_DESC(mmap_channels, "Number of channels per slot exposed through mmap (0 disables mmap)");
+
+// Whether the lookup and copy phases are timed into the per-slot latency histograms
+static bool latency_histograms;
+module_param(latency_histograms, bool, 0644);
+MODULE_PARM_DESC(latency_histograms, "Record log2 latency histograms of lookups and copies in debugfs");
+
+// Default maximum message size of new slots, adjustable per slot with MSG_SLOT_SET_MAX_LEN
+static unsigned int max_message_length = MAX_MESSAGE_LENGTH;
+module_param(max_message_length, uint, 0444);
+MODULE_PARM_DESC(max_message_length, "Default maximum message size of a slot, up to MSG_SLOT_MAX_LARGE_LENGTH");
+
+// NUMA node new slots are allocated on and place their channels and messages on, adjustable
+// per slot with MSG_SLOT_SET_NODE (-1: the node of the task allocating each object)
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0644);
+MODULE_PARM_DESC(numa_node, "NUMA node of new slots' storage, -1 for the allocating task's node");
+
+// Channels not written for this many seconds are deleted by the reaper (0 disables)
+static unsigned int channel_ttl_secs;
+static void reaper_kick(void);
+
+// channel_ttl_set: Sets channel_ttl_secs and runs the reaper, which then reschedules itself
+// for as long as the TTL is enabled
+static int channel_ttl_set(const char* val, const struct kernel_param* kp) {
+    int rc = param_set_uint(val, kp);
+
+    if (rc == 0)
+        reaper_kick();
+    return rc;
+}
+
+static const struct kernel_param_ops channel_ttl_ops = {
+    .set = channel_ttl_set,
+    .get = param_get_uint,
+};
+module_param_cb(channel_ttl_secs, &channel_ttl_ops, &channel_ttl_secs, 0644);
+MODULE_PARM_DESC(channel_ttl_secs, "Delete channels not written for this many seconds (0 keeps them forever)");
+
+// Memory a slot may use for its channels and messages before the least recently written
+// channels are deleted (0 disables)
+static unsigned int slot_memory_cap_kb;
+module_param(slot_memory_cap_kb, uint, 0644);
+MODULE_PARM_DESC(slot_memory_cap_kb, "Per-slot memory cap in KiB, enforced by deleting least recently written channels (0 is unlimited)");
+
+struct slot;
+
+// Represents an immutable published message. Writers publish a new buffer and retire
+// the old one after an RCU grace period, so readers never see a partially written message.
+// Messages of up to MAX_MESSAGE_LENGTH bytes come from message_cache with the payload
+// inline; larger ones are kvmalloc'ed page-backed buffers. A large message is too big
+// to snapshot under rcu_read_lock, so its readers pin it with a reference instead.
+// A multicast write publishes one message on many channels, each holding a reference,
+// and so does a write to a slot with deduplication enabled whose payload matches a
+// message already published in the slot.
+typedef struct message {
+    struct rcu_head rcu;
+    size_t length;
+    refcount_t refs;        // Held by every channel or queue it is published on, and by
+                            // readers of large messages
+    bool large;
+    int dedup_minor;        // Minor whose dedup table holds the message, or -1
+    u32 hash;               // Payload hash while in a dedup table
+    struct hlist_bl_node dedup_node;
+    char data[];
+} message_t;
+
+// One cell of a message queue: seq tells producers and consumers whose turn the cell is
+typedef struct queue_cell {
+    atomic_long_t seq;
+    message_t* message;
+} queue_cell_t;
+
+// Represents the optional bounded message queue of a channel (queue mode), a lock-free
+// multi-producer/multi-consumer ring in which every cell carries its own sequence number.
+// Producer and consumer positions live on separate cachelines. Queued messages are
+// owned by the queue until a reader dequeues them.
+typedef struct queue {
+    struct rcu_head rcu;
+    unsigned long mask;          // Capacity - 1, capacity being a power of two
+    unsigned int policy;         // MSG_SLOT_QUEUE_DROP_OLDEST or MSG_SLOT_QUEUE_BLOCK
+    atomic_long_t enqueue_pos ____cacheline_aligned;
+    atomic_long_t dequeue_pos ____cacheline_aligned;
+    queue_cell_t cells[];
+} queue_t;
+
+// Rate limit of a channel or fd, a token bucket implemented with the generic cell rate
+// algorithm: tat is the theoretical arrival time of the next write, advanced by interval_ns
+// per write with a single cmpxchg, and a write is throttled if that would take tat more
+// than limit_ns (interval_ns times the burst) past the present. An unlimited bucket
+// costs one load per write.
+typedef struct rate_limit {
+    u64 interval_ns;        // Nanoseconds per write, 0 when unlimited
+    u64 limit_ns;
+    bool block;             // Blocking writers sleep when throttled instead of failing
+    atomic64_t tat;         // In ktime_get_ns() time
+} rate_limit_t;
+
+// Represents a communication channel within a slot, pointing at its last published message.
+// The slot's channel index holds one reference, and every fd that selected the channel holds another.
+// Writers serialize on the channel's spinlock; readers only take rcu_read_lock.
+// Blocking readers and pollers sleep on the wait queue, which every write wakes.
+// In queue mode writes append to the queue instead, reads consume from it, and
+// writers blocked on a full queue sleep on space_wait.
+// The last retired message is kept as a spare and reused by the next write once the
+// grace period recorded in spare_gp has elapsed, saving an allocation per write.
+// A deleted channel is marked dead and unlinked from the slot; fds still holding it
+// replace it with a new channel of the same id on their next use.
+// Fields are grouped by who writes them, each group on its own cachelines: the fields
+// read on every transfer but written only at setup, the published message pointer and
+// sequence, the writer-side state, and the wait queues touched by sleepers. A reader's
+// snapshot thus only misses once per publish, never on the spinlock, refcount and
+// accounting that writers bounce between CPUs, and message payloads live in their own
+// cacheline-aligned buffers, away from every channel's metadata.
+typedef struct channel {
+    // Read-mostly: set at creation, or rarely (queue mode switches, deletion)
+    unsigned int id;
+    bool dead;                               // Deleted from the slot, set under lock
+    struct slot* slot;                       // Owning slot, outlived by the channel's users
+    queue_t __rcu* queue;                    // Non-NULL in queue mode
+    struct msg_slot_mmap_entry* mmap_entry;  // Mirror in the slot's mmap area, or NULL
+
+    // Written once by every publish, read by every reader
+    message_t __rcu* message ____cacheline_aligned;
+    u64 sequence;                            // Number of messages published, stored after
+                                             // the message pointer with release semantics
+
+    // Written by every write, and the refcount by fds taking a reference
+    spinlock_t lock ____cacheline_aligned;
+    struct kref refcount;
+    message_t* spare;
+    unsigned long spare_gp;
+    long memory;                             // Bytes charged to the slot, under lock
+    unsigned long last_write;                // jiffies of the last write, at 1s granularity
+    rate_limit_t rate;                       // Set with MSG_SLOT_SET_CHANNEL_RATE
+
+    // Written by sleepers and wakers
+    wait_queue_head_t wait ____cacheline_aligned;
+    wait_queue_head_t space_wait;
+
+    // Cold
+    struct list_head lru_node;               // In the slot's LRU list until deleted
+    struct rcu_head rcu;
+} channel_t;
+
+// Per-CPU statistics of a slot. Every counter is only ever incremented on the local CPU,
+// so hot paths write no shared cacheline; the debugfs stats file sums them on demand.
+typedef struct slot_stats {
+    u64 opens;
+    u64 reads;
+    u64 writes;
+    u64 read_empty;         // Reads failing with -EWOULDBLOCK
+    u64 write_too_big;      // Writes failing with -EMSGSIZE
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 channels_created;
+    u64 channels_deleted;   // By MSG_SLOT_DELETE_CHANNEL
+    u64 channels_reaped;    // By the reaper, for the TTL or the memory cap
+    u64 lookups_cached;     // Transfers on the channel cached in the fd, with no lookup
+    u64 lookups_index;      // Channel lookups in the slot's channel index
+    u64 dedup_hits;         // Writes that reused an identical message's buffer
+    u64 throttled;          // Writes held back by a rate limit
+} slot_stats_t;
+
+#define slot_stat_inc(slot, field) this_cpu_inc((slot)->stats->field)
+#define slot_stat_add(slot, field, n) this_cpu_add((slot)->stats->field, (n))
+
+// Per-CPU log2 latency histograms of a slot: bucket b counts phases that took less than
+// 2^b ns (and at least 2^(b-1) ns); the last bucket also takes everything slower
+enum {
+    LAT_LOOKUP,             // Channel lookup in the slot's channel index
+    LAT_WRITE_COPY,         // Copy (and censorship) of a written message from user space
+    LAT_READ_COPY,          // Copy of a read message to user space
+    LAT_PHASES
+};
+#define LAT_BUCKETS 32
+
+static const char* const lat_phase_names[LAT_PHASES] = { "lookup", "write_copy", "read_copy" };
+
+typedef struct slot_latency {
+    u64 buckets[LAT_PHASES][LAT_BUCKETS];
+} slot_latency_t;
+
+// Represents a device slot identified by a minor number, containing its channels
+// indexed by channel id so lookup cost does not grow with the number of channels.
+// The slot table holds one reference, and every open fd of the minor holds another.
+// Channel creation is serialized by the slot's mutex; lookups are RCU-protected.
+// Up to mmap_channels live channels also get an entry in mmap_area, which
+// readers can map to fetch the latest messages without a syscall.
+// Channels are kept on an LRU list by last write time, oldest first, from which the
+// reaper deletes idle channels and enforces the memory cap.
+typedef struct slot {
+    int minor;
+    struct kref refcount;
+    struct mutex lock;
+    struct xarray channels;
+    struct msg_slot_mmap_entry* mmap_area;
+    struct ida mmap_ida;                    // Indices of the mmap entries in use
+    unsigned int max_message_length;
+    bool dedup;                             // Set with MSG_SLOT_SET_DEDUP
+    int node;                               // NUMA node of new channels, queues and messages
+    spinlock_t lru_lock;
+    struct list_head lru;
+    struct percpu_counter memory;           // Bytes used by the slot's live channels
+    slot_stats_t __percpu* stats;
+    slot_latency_t __percpu* latency;
+    struct dentry* debugfs_dir;             // message_slot/<minor> in debugfs
+    struct rcu_head rcu;
+} slot_t;
+
+// Represents the subscription of an fd to a channel. Its wait queue entry sits on the
+// channel's wait queue and relays the channel's wake-ups to the fd's sub_wait.
+typedef struct subscription {
+    channel_t* channel;             // Referenced; replaced with a new channel if deleted
+    u64 last_seen;                  // Sequence of the last message returned
+    wait_queue_entry_t wait;
+    wait_queue_head_t* fd_wait;
+    struct rcu_head rcu;
+} subscription_t;
+
+// Represents the state of an open file descriptor: the slot resolved at open time,
+// the channel resolved at MSG_SLOT_CHANNEL time (both referenced), the censorship flag,
+// and the sequence of the last message read from the channel, against which poll
+// decides whether the channel has a new message.
+// The channel pointer is RCU-protected, as it is replaced when the channel is reselected
+// or deleted while other threads may be using it through the same fd.
+// poll() waits on the fd's own poll_wait, so that readiness follows the selected channel.
+// Once the fd is polled, the relay entries sit on the selected channel's wait queues and
+// forward their wake-ups there; fds that are never polled cost writers nothing.
+// The fd's subscriptions are indexed by channel id and read in one pass from sub_cursor on.
+// Plain reads and writes of the selected channel go through handlers specialized for the
+// fd's settings, so that the hot path does not branch on them (see fd_select_handlers).
+struct fd_state;
+typedef ssize_t (*fd_write_fn)(struct fd_state* state, const char __user* buffer, size_t length, int nonblock);
+typedef ssize_t (*fd_read_fn)(struct fd_state* state, char __user* buffer, size_t length, int nonblock);
+
+typedef struct fd_state {
+    unsigned int channel_id;
+    int censorship_enabled;
+    slot_t* slot;
+    spinlock_t lock;                // Serializes replacements of channel and its relays
+    channel_t __rcu* channel;
+    u64 last_seen;
+    wait_queue_head_t poll_wait;    // Woken through the relays by the selected channel
+    wait_queue_entry_t read_relay;  // On relay_channel's wait
+    wait_queue_entry_t space_relay; // On relay_channel's space_wait
+    channel_t* relay_channel;       // Channel the relays sit on, or NULL
+    int read_mode;                  // MSG_SLOT_READ_SELECTED or MSG_SLOT_READ_SUBSCRIBED
+    struct mutex sub_lock;          // Serializes changes and reads of the subscriptions
+    struct xarray subscriptions;    // subscription_t by channel id, freed after a grace period
+    unsigned int sub_count;
+    unsigned long sub_cursor;       // Channel id the next subscription read starts at
+    wait_queue_head_t sub_wait;     // Woken by writes to any subscribed channel
+    bool spliced;                   // The current sendfile() transfer carried its message
+    rate_limit_t rate;              // Set with MSG_SLOT_SET_FD_RATE
+    unsigned int fixed_size;        // Set with MSG_SLOT_SET_FIXED_SIZE, 0 for any size
+    fd_write_fn write;
+    fd_read_fn read;
+} fd_state_t;
+
+// Global table of device slots currently in use, indexed directly by minor number
+static slot_t __rcu* slot_table[SLOT_TABLE_SIZE];
+// Serializes slot creation in device_open
+static DEFINE_MUTEX(slot_table_lock);
+
+// Root of the module's debugfs directory
+static struct dentry* debugfs_root;
+
+// Interval at which the reaper looks for idle channels while the TTL is enabled
+#define REAPER_PERIOD HZ
+
+// The reaper may only be queued between module initialization and cleanup
+static bool reaper_enabled;
+// Set while the reaper is queued to run right away, so writers over the memory cap kick it once
+static atomic_t reaper_urgent = ATOMIC_INIT(0);
+static void reaper_work_fn(struct work_struct* work);
+static DECLARE_DELAYED_WORK(reaper_work, reaper_work_fn);
+
+// reaper_kick: Runs the reaper as soon as possible, unless it is already about to run
+static void reaper_kick(void) {
+    if (READ_ONCE(reaper_enabled) && !atomic_read(&reaper_urgent) && !atomic_xchg(&reaper_urgent, 1))
+        mod_delayed_work(system_wq, &reaper_work, 0);
+}
+
+// lat_start: Starts timing a phase; returns 0 when latency histograms are disabled
+static inline u64 lat_start(void) {
+    return READ_ONCE(latency_histograms) ? ktime_get_ns() : 0;
+}
+
+// lat_record: Adds the time elapsed since lat_start to a phase of the slot's histograms
+static inline void lat_record(struct slot* slot, int phase, u64 start) {
+    if (start)
+        this_cpu_inc(slot->latency->buckets[phase][min_t(int, fls64(ktime_get_ns() - start), LAT_BUCKETS - 1)]);
+}
+
+// Dedicated slab caches, visible in /proc/slabinfo, for every structure the module allocates
+static struct kmem_cache* message_cache;
+static struct kmem_cache* channel_cache;
+static struct kmem_cache* slot_cache;
+static struct kmem_cache* fd_state_cache;
+static struct kmem_cache* subscription_cache;
+
+// Table of the messages published in slots with deduplication enabled, shared by all
+// slots and keyed by payload hash and minor. It holds no references: a message is
+// removed when its last reference is dropped. Buckets are also locked from RCU
+// callbacks, so process context takes them with bottom halves disabled.
+#define DEDUP_BITS 12
+static struct hlist_bl_head dedup_table[1 << DEDUP_BITS];
+
+static struct hlist_bl_head* dedup_bucket(int minor, u32 hash) {
+    return &dedup_table[hash_32(hash + minor, DEDUP_BITS)];
+}
+
+// Value of a transfer's nonblock argument when it must not sleep at all, as for an inline
+// io_uring issue or an IOCB_NOWAIT iocb: besides never waiting for a message or for queue
+// space, it only uses existing channels and allocates with GFP_NOWAIT, failing with -EAGAIN
+// where it would otherwise have to sleep
+#define NONBLOCK_NOWAIT 2
+
+// message_alloc: Allocates a message able to hold length bytes, inline or page-backed,
+// on the given NUMA node (or NUMA_NO_NODE for the local one)
+static message_t* message_alloc(size_t length, int node, gfp_t gfp) {
+    message_t* message;
+
+    if (length <= MAX_MESSAGE_LENGTH) {
+        message = kmem_cache_alloc_node(message_cache, gfp, node);
+        if (message)
+            message->large = false;
+    } else {
+        message = kvmalloc_node(sizeof(message_t) + length, gfp, node);
+        if (message)
+            message->large = true;
+    }
+    if (message)
+        message->dedup_minor = -1;
+    return message;
+}
+
+static void message_free(message_t* message) {
+    if (!message)
+        return;
+    if (message->large)
+        kvfree(message);
+    else
+        kmem_cache_free(message_cache, message);
+}
+
+// message_free_rcu: Frees a retired message once no RCU reader can still see it
+static void message_free_rcu(struct rcu_head* rcu) {
+    message_free(container_of(rcu, message_t, rcu));
+}
+
+// message_put: Drops a reference on a message, freeing it after a grace period when it was
+// the last. A message in a dedup table is removed from it first, under the bucket lock,
+// so that lookups racing with the last put fail to take a reference and skip it.
+static void message_put(message_t* message) {
+    struct hlist_bl_head* bucket;
+
+    if (!refcount_dec_and_test(&message->refs))
+        return;
+    if (message->dedup_minor >= 0) {
+        bucket = dedup_bucket(message->dedup_minor, message->hash);
+        local_bh_disable();
+        hlist_bl_lock(bucket);
+        hlist_bl_del(&message->dedup_node);
+        hlist_bl_unlock(bucket);
+        local_bh_enable();
+    }
+    call_rcu(&message->rcu, message_free_rcu);
+}
+
+// message_dedup: Looks up a message with the same payload in the dedup table of a slot.
+// Takes over the caller's reference on a message nobody else can see yet, and returns
+// either an identical published message with a reference for the caller, freeing the
+// new one, or the new message itself after adding it to the table.
+// Payloads can be up to MSG_SLOT_MAX_LARGE_LENGTH long, so they are compared outside the
+// bucket lock: a candidate whose hash and length match is referenced under the lock and
+// compared after dropping it, and the next pass skips the candidates already compared.
+// Candidates added meanwhile may be missed, which only costs a duplicate payload.
+static message_t* message_dedup(struct slot* slot, message_t* message) {
+    u32 hash = jhash(message->data, message->length, 0);
+    struct hlist_bl_head* bucket = dedup_bucket(slot->minor, hash);
+    struct hlist_bl_node* node;
+    message_t* found;
+    message_t* cur;
+    unsigned int compared = 0;
+    unsigned int skip;
+
+    for (;;) {
+        found = NULL;
+        skip = compared;
+        local_bh_disable();
+        hlist_bl_lock(bucket);
+        hlist_bl_for_each_entry(cur, node, bucket, dedup_node) {
+            if (cur->hash != hash || cur->dedup_minor != slot->minor || cur->length != message->length)
+                continue;
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            if (refcount_inc_not_zero(&cur->refs)) {
+                found = cur;
+                break;
+            }
+            compared++;     // Being freed; the next candidate is tried instead
+        }
+        if (!found) {
+            message->hash = hash;
+            message->dedup_minor = slot->minor;
+            hlist_bl_add_head(&message->dedup_node, bucket);
+        }
+        hlist_bl_unlock(bucket);
+        local_bh_enable();
+
+        if (!found)
+            return message;
+        // A hashed message is never reused as a spare, so its payload stays as published
+        if (memcmp(found->data, message->data, message->length) == 0)
+            break;
+        message_put(found);
+        compared++;
+    }
+    message_free(message);
+    slot_stat_inc(slot, dedup_hits);
+    return found;
+}
+
+// message_footprint: Returns the memory charged to a channel for holding a message
+static size_t message_footprint(const message_t* message) {
+    return sizeof(message_t) + (message->large ? message->length : MAX_MESSAGE_LENGTH);
+}
+
+// queue_alloc: Allocates an empty queue of the given power-of-two capacity on a NUMA node
+static queue_t* queue_alloc(unsigned int capacity, unsigned int policy, int node) {
+    queue_t* queue = kvmalloc_node(struct_size(queue, cells, capacity), GFP_KERNEL, node);
+    unsigned int i;
+
+    if (!queue)
+        return NULL;
+    queue->mask = capacity - 1;
+    queue->policy = policy;
+    atomic_long_set(&queue->enqueue_pos, 0);
+    atomic_long_set(&queue->dequeue_pos, 0);
+    for (i = 0; i < capacity; i++) {
+        atomic_long_set(&queue->cells[i].seq, i);
+        queue->cells[i].message = NULL;
+    }
+    return queue;
+}
+
+// queue_push: Appends a message to a queue. Returns false if the queue is full.
+static bool queue_push(queue_t* queue, message_t* message) {
+    long pos = atomic_long_read(&queue->enqueue_pos);
+    queue_cell_t* cell;
+    long diff;
+
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        diff = atomic_long_read_acquire(&cell->seq) - pos;
+        if (diff == 0) {
+            if (atomic_long_try_cmpxchg(&queue->enqueue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_long_read(&queue->enqueue_pos);
+        }
+    }
+    cell->message = message;
+    atomic_long_set_release(&cell->seq, pos + 1);
+    return true;
+}
+
+// queue_pop: Removes and returns the oldest message of a queue, or NULL if it is empty.
+// A message longer than limit is left at the head and ERR_PTR(-ENOSPC) returned instead.
+// The caller takes over the queue's reference on the message. Called under rcu_read_lock,
+// as a message seen at the head may be popped and put by another reader meanwhile.
+static message_t* queue_pop(queue_t* queue, size_t limit) {
+    long pos = atomic_long_read(&queue->dequeue_pos);
+    queue_cell_t* cell;
+    message_t* message;
+    long diff;
+
+    for (;;) {
+        cell = &queue->cells[pos & queue->mask];
+        diff = atomic_long_read_acquire(&cell->seq) - (pos + 1);
+        if (diff == 0) {
+            // The cell holds the message of pos for as long as dequeue_pos has not moved
+            message = READ_ONCE(cell->message);
+            if (message->length > limit) {
+                if (atomic_long_read(&queue->dequeue_pos) == pos)
+                    return ERR_PTR(-ENOSPC);
+                pos = atomic_long_read(&queue->dequeue_pos);
+                continue;
+            }
+            if (atomic_long_try_cmpxchg(&queue->dequeue_pos, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_long_read(&queue->dequeue_pos);
+        }
+    }
+    message = cell->message;
+    atomic_long_set_release(&cell->seq, pos + queue->mask + 1);
+    return message;
+}
+
+static bool queue_empty(queue_t* queue) {
+    long pos = atomic_long_read(&queue->dequeue_pos);
+
+    return atomic_long_read_acquire(&queue->cells[pos & queue->mask].seq) - (pos + 1) < 0;
+}
+
+static bool queue_full(queue_t* queue) {
+    long pos = atomic_long_read(&queue->enqueue_pos);
+
+    return atomic_long_read_acquire(&queue->cells[pos & queue->mask].seq) - pos < 0;
+}
+
+// queue_footprint: Returns the memory charged to a channel for its queue ring
+static size_t queue_footprint(const queue_t* queue) {
+    return struct_size(queue, cells, queue->mask + 1);
+}
+
+// queue_free: Frees a queue no one can access any more, dropping its references on its
+// queued messages. Returns the memory freed.
+static size_t queue_free(queue_t* queue) {
+    message_t* message;
+    size_t freed;
+
+    if (!queue)
+        return 0;
+    freed = queue_footprint(queue);
+    while ((message = queue_pop(queue, SIZE_MAX))) {
+        freed += message_footprint(message);
+        message_put(message);
+    }
+    kvfree(queue);
+    return freed;
+}
+
+// channel_free_rcu: Frees a channel and its queue once no RCU reader can still see them,
+// and drops its references on its messages. Other channels may share a message, whose
+// readers need a grace period of their own, so the message is put rather than freed.
+static void channel_free_rcu(struct rcu_head* rcu) {
+    channel_t* channel = container_of(rcu, channel_t, rcu);
+    message_t* message = rcu_dereference_protected(channel->message, 1);
+
+    if (message)
+        message_put(message);
+    message_free(channel->spare);   // Never shared
+    queue_free(rcu_dereference_protected(channel->queue, 1));
+    kmem_cache_free(channel_cache, channel);
+}
+
+// channel_release: Frees a channel once its last reference is dropped
+static void channel_release(struct kref* kref) {
+    channel_t* channel = container_of(kref, channel_t, refcount);
+
+    // No poller sits on the wait queues: fds poll their own queue through relays, which
+    // are removed before an fd drops its reference
+    call_rcu(&channel->rcu, channel_free_rcu);
+}
+
+static void channel_put(channel_t* channel) {
+    kref_put(&channel->refcount, channel_release);
+}
+
+// channel_charge: Adds bytes (possibly negative) to the memory used by a channel and,
+// unless the channel was deleted, by its slot. The slot's count is per-CPU, so writers of
+// different channels do not bounce one cacheline. Called with the channel lock held.
+static void channel_charge(channel_t* channel, long bytes) {
+    if (bytes == 0)
+        return;
+    channel->memory += bytes;
+    if (!channel->dead)
+        percpu_counter_add(&channel->slot->memory, bytes);
+}
+
+// channel_get_buffer: Returns a buffer for the next message of a channel, reusing the
+// spare for inline-sized messages if no RCU reader can still see it and allocating
+// a new buffer otherwise, without sleeping for a NONBLOCK_NOWAIT transfer
+static message_t* channel_get_buffer(channel_t* channel, size_t length, int nonblock) {
+    message_t* message = NULL;
+
+    if (length <= MAX_MESSAGE_LENGTH) {
+        spin_lock(&channel->lock);
+        if (channel->spare && poll_state_synchronize_rcu(channel->spare_gp)) {
+            message = channel->spare;
+            channel->spare = NULL;
+        }
+        spin_unlock(&channel->lock);
+    }
+
+    if (!message)
+        message = message_alloc(length, READ_ONCE(channel->slot->node),
+                                nonblock == NONBLOCK_NOWAIT ? GFP_NOWAIT : GFP_KERNEL);
+    if (message)
+        refcount_set(&message->refs, 1);   // Reference owned by the channel once published
+    return message;
+}
+
+// mirror_assign: Hands an mmap entry over to a channel id, or clears it with id 0. The id
+// changes within a write section together with the length, so that a reader of a reused
+// entry never pairs the new id with the previous channel's message.
+static void mirror_assign(struct msg_slot_mmap_entry* entry, unsigned int id) {
+    __u32 seq = entry->sequence;
+
+    WRITE_ONCE(entry->sequence, seq + 1);
+    smp_wmb();
+    WRITE_ONCE(entry->channel_id, id);
+    WRITE_ONCE(entry->length, 0);
+    smp_wmb();
+    WRITE_ONCE(entry->sequence, seq + 2);
+}
+
+// mirror_store: Stores a message into an mmap entry using the seqcount protocol documented
+// in message_slot.h. Only the first MAX_MESSAGE_LENGTH bytes of a large message are mirrored.
+static void mirror_store(struct msg_slot_mmap_entry* entry, const char* data, size_t length) {
+    __u32 seq = entry->sequence;
+
+    WRITE_ONCE(entry->sequence, seq + 1);
+    smp_wmb();
+    memcpy(entry->message, data, min_t(size_t, length, MAX_MESSAGE_LENGTH));
+    WRITE_ONCE(entry->length, (__u32) length);
+    smp_wmb();
+    WRITE_ONCE(entry->sequence, seq + 2);
+}
+
+// channel_mirror: Copies a message into the channel's mmap entry. Called with the channel lock held.
+static void channel_mirror(channel_t* channel, const message_t* message) {
+    mirror_store(channel->mmap_entry, message->data, message->length);
+}
+
+// channel_queue_readable: Wait condition of queue readers, true once a message is queued,
+// queue mode was turned off or the channel was deleted
+static bool channel_queue_readable(channel_t* channel) {
+    queue_t* queue;
+    bool readable;
+
+    rcu_read_lock();
+    queue = rcu_dereference(channel->queue);
+    readable = !queue || !queue_empty(queue) || READ_ONCE(channel->dead);
+    rcu_read_unlock();
+    return readable;
+}
+
+// channel_queue_full: Wait condition of blocked queue writers, false once there is room,
+// queue mode was turned off or the channel was deleted
+static bool channel_queue_full(channel_t* channel) {
+    queue_t* queue;
+    bool full;
+
+    rcu_read_lock();
+    queue = rcu_dereference(channel->queue);
+    full = queue && queue_full(queue) && !READ_ONCE(channel->dead);
+    rcu_read_unlock();
+    return full;
+}
+
+// channel_set_queue: Switches a channel to queue mode with the given capacity and overflow
+// policy, or back to overwrite mode for capacity 0. Messages still queued in a replaced
+// queue are dropped, and so is the last published message on entering queue mode, where
+// reads only consume the queue. Serialized by the slot lock.
+static int channel_set_queue(channel_t* channel, const struct msg_slot_queue_config* config) {
+    queue_t* queue = NULL;
+    queue_t* old;
+    message_t* retired = NULL;
+    size_t freed;
+
+    if (config->capacity > MSG_SLOT_QUEUE_MAX_CAPACITY ||
+        (config->capacity && !is_power_of_2(config->capacity)) ||
+        (config->policy != MSG_SLOT_QUEUE_DROP_OLDEST && config->policy != MSG_SLOT_QUEUE_BLOCK)) {
+        return -EINVAL;
+    }
+    if (config->capacity) {
+        queue = queue_alloc(config->capacity, config->policy, READ_ONCE(channel->slot->node));
+        if (!queue)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&channel->slot->lock);
+    old = rcu_replace_pointer(channel->queue, queue, lockdep_is_held(&channel->slot->lock));
+    mutex_unlock(&channel->slot->lock);
+    if (queue) {
+        spin_lock(&channel->lock);
+        channel_charge(channel, queue_footprint(queue));
+        if (!old) {
+            retired = rcu_replace_pointer(channel->message, NULL, lockdep_is_held(&channel->lock));
+            if (retired)
+                channel_charge(channel, -(long) message_footprint(retired));
+        }
+        spin_unlock(&channel->lock);
+        if (retired)
+            message_put(retired);
+    }
+
+    // Let blocked readers and writers re-evaluate against the new mode
+    wake_up_interruptible(&channel->wait);
+    wake_up_interruptible(&channel->space_wait);
+    if (old) {
+        synchronize_rcu();
+        freed = queue_free(old);
+        spin_lock(&channel->lock);
+        channel_charge(channel, -(long) freed);
+        spin_unlock(&channel->lock);
+    }
+    return 0;
+}
+
+// channel_sequence: Returns the sequence of a channel. A message loaded after it is at
+// least as new as the message the sequence counts, so a reader recording the sequence
+// as seen may re-read a message but never misses one.
+static u64 channel_sequence(channel_t* channel) {
+    return smp_load_acquire(&channel->sequence);
+}
+
+// channel_publish: Makes a message the current one of a channel, retires the previous
+// message (keeping an unshared, unhashed inline one as the spare, or dropping the
+// channel's reference) and wakes readers
+static void channel_publish(channel_t* channel, message_t* message) {
+    message_t* old;
+
+    spin_lock(&channel->lock);
+    old = rcu_replace_pointer(channel->message, message, lockdep_is_held(&channel->lock));
+    smp_store_release(&channel->sequence, channel->sequence + 1);
+    if (channel->mmap_entry)
+        channel_mirror(channel, message);
+    // One charge for the difference, which is 0 when an inline message replaces another
+    channel_charge(channel, (long) message_footprint(message) - (old ? (long) message_footprint(old) : 0));
+    if (old) {
+        if (!old->large && !channel->spare && refcount_read(&old->refs) == 1 && old->dedup_minor < 0) {
+            channel->spare = old;
+            channel->spare_gp = get_state_synchronize_rcu();
+        } else {
+            message_put(old);
+        }
+    }
+    spin_unlock(&channel->lock);
+
+    if (wq_has_sleeper(&channel->wait))
+        wake_up_interruptible(&channel->wait);
+}
+
+// Censorship replaces every byte whose index is 2 mod 3 with '#'. The pattern repeats
+// every 24 bytes, i.e. every three 64-bit words, so it is applied a word at a time
+// with these per-word masks, built once at module load.
+#define CENSOR_PERIOD_WORDS 3
+#define CENSOR_PERIOD_BYTES (CENSOR_PERIOD_WORDS * sizeof(u64))
+// Messages are copied from user space in chunks of this many bytes (a whole number of
+// periods), each censored right after its copy while it is still hot in L1
+#define CENSOR_CHUNK_BYTES (16 * CENSOR_PERIOD_BYTES)
+
+static u64 censor_keep[CENSOR_PERIOD_WORDS] __read_mostly;
+static u64 censor_fill[CENSOR_PERIOD_WORDS] __read_mostly;
+
+// censor_init_masks: Builds the per-word masks from the byte pattern, independent of endianness
+static void __init censor_init_masks(void) {
+    u8 keep[CENSOR_PERIOD_BYTES];
+    u8 fill[CENSOR_PERIOD_BYTES];
+    size_t i;
+
+    for (i = 0; i < CENSOR_PERIOD_BYTES; i++) {
+        keep[i] = (i % 3 == 2) ? 0x00 : 0xff;
+        fill[i] = (i % 3 == 2) ? '#' : 0x00;
+    }
+    memcpy(censor_keep, keep, sizeof(keep));
+    memcpy(censor_fill, fill, sizeof(fill));
+}
+
+// censor_block: Censors a buffer whose first byte has index 0 mod 3 within the message
+static __always_inline void censor_block(char* buf, size_t length) {
+    u64 words[CENSOR_PERIOD_WORDS];
+    size_t i;
+    int w;
+
+    // memcpy keeps the word accesses alignment-safe; it compiles to plain loads and stores
+    for (i = 0; i + CENSOR_PERIOD_BYTES <= length; i += CENSOR_PERIOD_BYTES) {
+        memcpy(words, buf + i, sizeof(words));
+        for (w = 0; w < CENSOR_PERIOD_WORDS; w++) {
+            words[w] = (words[w] & censor_keep[w]) | censor_fill[w];
+        }
+        memcpy(buf + i, words, sizeof(words));
+    }
+    for (i += 2; i < length; i += 3) {
+        buf[i] = '#';
+    }
+}
+
+// censor_copy_from_user: Copies a message from user space and censors it in the same pass
+static __always_inline int censor_copy_from_user(char* dst, const char __user* src, size_t length) {
+    size_t done, chunk;
+
+    for (done = 0; done < length; done += chunk) {
+        chunk = min_t(size_t, length - done, CENSOR_CHUNK_BYTES);
+        if (copy_from_user(dst + done, src + done, chunk)) {
+            return -EFAULT;
+        }
+        censor_block(dst + done, chunk);
+    }
+    return 0;
+}
+
+// channel_enqueue: Appends a message to the queue of a channel in queue mode. If the queue
+// is full, the oldest message is dropped or, with MSG_SLOT_QUEUE_BLOCK, the writer waits
+// for space (failing with -EAGAIN when nonblock is set, and with -EIDRM if the channel is
+// deleted meanwhile). Falls back to channel_publish if queue mode was turned off
+// meanwhile. Returns 0 once the message is queued.
+static int channel_enqueue(channel_t* channel, message_t* message, int nonblock) {
+    queue_t* queue;
+    message_t* dropped;
+    bool queued;
+
+    for (;;) {
+        rcu_read_lock();
+        queue = rcu_dereference(channel->queue);
+        if (!queue) {
+            rcu_read_unlock();
+            channel_publish(channel, message);
+            return 0;
+        }
+
+        // Producers serialize on the channel lock so sequences follow queue order
+        spin_lock(&channel->lock);
+        queued = queue_push(queue, message);
+        if (queued) {
+            smp_store_release(&channel->sequence, channel->sequence + 1);
+            if (channel->mmap_entry)
+                channel_mirror(channel, message);
+            channel_charge(channel, message_footprint(message));
+        }
+        spin_unlock(&channel->lock);
+
+        if (queued) {
+            rcu_read_unlock();
+            break;
+        }
+        if (queue->policy == MSG_SLOT_QUEUE_DROP_OLDEST) {
+            dropped = queue_pop(queue, SIZE_MAX);
+            rcu_read_unlock();
+            if (dropped) {
+                spin_lock(&channel->lock);
+                channel_charge(channel, -(long) message_footprint(dropped));
+                spin_unlock(&channel->lock);
+                message_put(dropped);
+            }
+            continue;
+        }
+        rcu_read_unlock();
+
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        if (READ_ONCE(channel->dead)) {
+            return -EIDRM;
+        }
+        if (wait_event_interruptible(channel->space_wait, !channel_queue_full(channel))) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    if (wq_has_sleeper(&channel->wait))
+        wake_up_interruptible(&channel->wait);
+    return 0;
+}
+
+// rate_limit_init: Initializes an unlimited rate limit
+static void rate_limit_init(rate_limit_t* rl) {
+    rl->interval_ns = 0;
+    rl->limit_ns = 0;
+    rl->block = false;
+    atomic64_set(&rl->tat, 0);
+}
+
+// rate_limit_set: Applies a user's rate limit configuration. Writes racing with the change
+// may still be admitted under the old limit.
+static int rate_limit_set(rate_limit_t* rl, const struct msg_slot_rate_limit* config) {
+    u64 interval;
+
+    if (config->rate > NSEC_PER_SEC || config->burst > MSG_SLOT_RATE_MAX_BURST ||
+        (config->flags & ~MSG_SLOT_RATE_BLOCK) || config->reserved) {
+        return -EINVAL;
+    }
+    if (config->rate == 0) {
+        WRITE_ONCE(rl->interval_ns, 0);
+        return 0;
+    }
+    interval = div_u64(NSEC_PER_SEC, config->rate);
+    WRITE_ONCE(rl->interval_ns, 0);
+    WRITE_ONCE(rl->limit_ns, interval * max_t(u32, config->burst, 1));
+    WRITE_ONCE(rl->block, (config->flags & MSG_SLOT_RATE_BLOCK) != 0);
+    atomic64_set(&rl->tat, 0);   // Start with a full bucket
+    WRITE_ONCE(rl->interval_ns, interval);
+    return 0;
+}
+
+// rate_limit_take: Takes a token for one write at time now. Returns 0 if the write is
+// admitted, or the nanoseconds until it would be.
+static u64 rate_limit_take(rate_limit_t* rl, u64 now) {
+    u64 interval = READ_ONCE(rl->interval_ns);
+    u64 limit = READ_ONCE(rl->limit_ns);
+    s64 tat, next;
+
+    if (!interval)
+        return 0;
+    tat = atomic64_read(&rl->tat);
+    do {
+        next = max_t(s64, tat, now) + interval;
+        if (next - (s64) now > (s64) limit)
+            return next - now - limit;
+    } while (!atomic64_try_cmpxchg(&rl->tat, &tat, next));
+    return 0;
+}
+
+// rate_limit_refund: Gives back the token of a write admitted by rate_limit_take
+static void rate_limit_refund(rate_limit_t* rl) {
+    u64 interval = READ_ONCE(rl->interval_ns);
+
+    if (interval)
+        atomic64_sub(interval, &rl->tat);
+}
+
+// rate_limit_wait: Sleeps for the given nanoseconds on behalf of a throttled writer.
+// Returns 0, or -ERESTARTSYS if interrupted by a signal.
+static int rate_limit_wait(u64 wait) {
+    ktime_t expires = ns_to_ktime(wait);
+
+    set_current_state(TASK_INTERRUPTIBLE);
+    schedule_hrtimeout(&expires, HRTIMER_MODE_REL);
+    return signal_pending(current) ? -ERESTARTSYS : 0;
+}
+
+// writer_admit: Admits one write through a fd to a channel under the rate limits of both,
+// counting throttled attempts in the slot statistics. A throttled write fails with -EAGAIN,
+// or sleeps until admitted if the limit that throttled it blocks and nonblock is not set.
+// Either limit may be NULL. Returns 0 once admitted.
+static int writer_admit(slot_t* slot, rate_limit_t* fd_rate, rate_limit_t* channel_rate, int nonblock) {
+    rate_limit_t* throttler;
+    u64 wait;
+    int rc;
+
+    if ((!fd_rate || !READ_ONCE(fd_rate->interval_ns)) && (!channel_rate || !READ_ONCE(channel_rate->interval_ns))) {
+        return 0;
+    }
+
+    for (;;) {
+        u64 now = ktime_get_ns();
+
+        throttler = fd_rate;
+        wait = fd_rate ? rate_limit_take(fd_rate, now) : 0;
+        if (!wait && channel_rate) {
+            throttler = channel_rate;
+            wait = rate_limit_take(channel_rate, now);
+            if (wait && fd_rate)
+                rate_limit_refund(fd_rate);
+        }
+        if (!wait) {
+            return 0;
+        }
+
+        slot_stat_inc(slot, throttled);
+        if (nonblock || !READ_ONCE(throttler->block)) {
+            return -EAGAIN;
+        }
+        rc = rate_limit_wait(wait);
+        if (rc) {
+            return rc;
+        }
+    }
+}
+
+// writer_refund: Gives back the tokens taken by writer_admit for a write that then failed,
+// so that neither a rejected write nor the retry of one on a replacement channel counts
+// against the limits. Either limit may be NULL.
+static void writer_refund(rate_limit_t* fd_rate, rate_limit_t* channel_rate) {
+    if (fd_rate)
+        rate_limit_refund(fd_rate);
+    if (channel_rate)
+        rate_limit_refund(channel_rate);
+}
+
+// channel_touch: Records a write to a channel for the reaper, moving the channel to the tail
+// of its slot's LRU list at most once a second, and kicks the reaper if the slot has gone
+// over its memory cap
+static void channel_touch(channel_t* channel) {
+    slot_t* slot = channel->slot;
+    unsigned long now = jiffies;
+    unsigned int cap_kb = READ_ONCE(slot_memory_cap_kb);
+
+    if (time_after_eq(now, READ_ONCE(channel->last_write) + HZ)) {
+        WRITE_ONCE(channel->last_write, now);
+        spin_lock(&slot->lru_lock);
+        if (!list_empty(&channel->lru_node))
+            list_move_tail(&channel->lru_node, &slot->lru);
+        spin_unlock(&slot->lru_lock);
+    }
+    if (cap_kb && percpu_counter_compare(&slot->memory, (s64) cap_kb * 1024) > 0)
+        reaper_kick();
+}
+
+// message_copy_from_user: Copies a message from user space into a message buffer, replacing
+// every third character with '#' if censor is set, and times the copy in the slot's histograms
+static __always_inline int message_copy_from_user(struct slot* slot, message_t* message,
+                                                  const char __user* buffer, size_t length, int censor) {
+    u64 start = lat_start();
+
+    if (censor ? censor_copy_from_user(message->data, buffer, length)
+               : copy_from_user(message->data, buffer, length)) {
+        return -EFAULT;
+    }
+    lat_record(slot, LAT_WRITE_COPY, start);
+    message->length = length;
+    return 0;
+}
+
+// message_copy_from_iter: Like message_copy_from_user, for a message taken from an iov_iter
+// (a writev() vector or the pages of a pipe being spliced)
+static int message_copy_from_iter(struct slot* slot, message_t* message, struct iov_iter* from, size_t length,
+                                  int censor) {
+    u64 start = lat_start();
+    size_t done, chunk;
+
+    for (done = 0; done < length; done += chunk) {
+        chunk = min_t(size_t, length - done, CENSOR_CHUNK_BYTES);
+        if (!copy_from_iter_full(message->data + done, chunk, from)) {
+            return -EFAULT;
+        }
+        if (censor)
+            censor_block(message->data + done, chunk);
+    }
+    lat_record(slot, LAT_WRITE_COPY, start);
+    message->length = length;
+    return 0;
+}
+
+// channel_commit_message: Publishes a filled message buffer on a channel, or appends it to
+// the channel's queue in queue mode, after deduplicating it if the slot asks for it.
+// Takes over the caller's reference. Returns the message length, or an error code.
+static ssize_t channel_commit_message(channel_t* channel, message_t* message, int nonblock) {
+    size_t length = message->length;
+    int rc;
+
+    if (READ_ONCE(channel->slot->dedup))
+        message = message_dedup(channel->slot, message);
+
+    if (rcu_access_pointer(channel->queue)) {
+        rc = channel_enqueue(channel, message, nonblock);
+        if (rc) {
+            message_put(message);   // Not published here, but possibly shared through dedup
+            return rc;
+        }
+    } else {
+        // Publish the message, serialized against other writers of this channel only
+        channel_publish(channel, message);
+    }
+    channel_touch(channel);
+    return length;
+}
+
+// channel_write_message: Writes a message to a channel, applying censorship if requested.
+// The message is copied from user space straight into the buffer it is published in,
+// censored during the copy and published with an RCU pointer swap.
+// Returns the number of bytes written, or an appropriate error code.
+static __always_inline ssize_t channel_write_message(channel_t* channel, const char __user* buffer,
+                                                     size_t length, int censor, int nonblock) {
+    message_t* message;
+
+    if (length == 0 || length > READ_ONCE(channel->slot->max_message_length)) {
+        return -EMSGSIZE;
+    }
+
+    // Get the buffer the message is built in
+    message = channel_get_buffer(channel, length, nonblock);
+    if (!message)
+        return nonblock == NONBLOCK_NOWAIT ? -EAGAIN : -ENOMEM;
+    if (message_copy_from_user(channel->slot, message, buffer, length, censor)) {
+        message_free(message);
+        return -EFAULT;
+    }
+    return channel_commit_message(channel, message, nonblock);
+}
+
+// channel_write_iter: Like channel_write_message for the whole of an iov_iter as one message
+static ssize_t channel_write_iter(channel_t* channel, struct iov_iter* from, int censor, int nonblock) {
+    size_t length = iov_iter_count(from);
+    message_t* message;
+
+    if (length == 0 || length > READ_ONCE(channel->slot->max_message_length)) {
+        return -EMSGSIZE;
+    }
+
+    message = channel_get_buffer(channel, length, nonblock);
+    if (!message)
+        return nonblock == NONBLOCK_NOWAIT ? -EAGAIN : -ENOMEM;
+    if (message_copy_from_iter(channel->slot, message, from, length, censor)) {
+        message_free(message);
+        return -EFAULT;
+    }
+    return channel_commit_message(channel, message, nonblock);
+}
+
+// channel_pop: Removes the oldest message of a channel in queue mode for a reader whose
+// buffer has the given length. The buffer must be able to hold the largest message the
+// slot accepts, and the message itself, which can be longer if the maximum was lowered
+// after it was queued: a message is never dequeued without fitting. Blocks while the
+// queue is empty unless nonblock is set. Returns the message, with the queue's reference
+// passed to the caller, or ERR_PTR of an error code, -EIDRM if the channel was deleted
+// while empty, or -ENOENT if queue mode is off.
+static message_t* channel_pop(channel_t* channel, size_t length, int nonblock) {
+    queue_t* queue;
+    message_t* message;
+
+    if (length < READ_ONCE(channel->slot->max_message_length)) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    for (;;) {
+        rcu_read_lock();
+        queue = rcu_dereference(channel->queue);
+        if (!queue) {
+            rcu_read_unlock();
+            return ERR_PTR(-ENOENT);
+        }
+        message = queue_pop(queue, length);
+        rcu_read_unlock();
+
+        if (IS_ERR(message)) {
+            return message;
+        }
+        if (message) {
+            break;
+        }
+        if (nonblock) {
+            return ERR_PTR(-EWOULDBLOCK);
+        }
+        if (READ_ONCE(channel->dead)) {
+            return ERR_PTR(-EIDRM);
+        }
+        if (wait_event_interruptible(channel->wait, channel_queue_readable(channel))) {
+            return ERR_PTR(-ERESTARTSYS);
+        }
+    }
+
+    spin_lock(&channel->lock);
+    channel_charge(channel, -(long) message_footprint(message));
+    spin_unlock(&channel->lock);
+    if (wq_has_sleeper(&channel->space_wait))
+        wake_up_interruptible(&channel->space_wait);
+    return message;
+}
+
+// channel_dequeue: Consumes the oldest message of a channel in queue mode into a user buffer.
+// Returns the number of bytes read, or an error code as for channel_pop.
+static ssize_t channel_dequeue(channel_t* channel, char __user* buffer, size_t length, int nonblock) {
+    message_t* message = channel_pop(channel, length, nonblock);
+    ssize_t rc;
+
+    if (IS_ERR(message)) {
+        return PTR_ERR(message);
+    }
+    rc = message->length;
+    if (copy_to_user(buffer, message->data, message->length))
+        rc = -EFAULT;
+    message_put(message);
+    return rc;
+}
+
+// channel_snapshot: Copies the current message of a channel into data if it is an inline
+// one, storing the channel's sequence in *sequence. Called under rcu_read_lock. A non-zero
+// fixed, a compile-time constant in the specialized readers, only accepts messages of
+// exactly that length and copies them with a constant-size memcpy.
+// Returns the message length, or 0 if the channel is empty or its message is large.
+static __always_inline size_t channel_snapshot(channel_t* channel, char* data, u64* sequence, size_t fixed) {
+    u64 seq = channel_sequence(channel);
+    message_t* message = rcu_dereference(channel->message);
+
+    if (!message || message->large)
+        return 0;
+    if (fixed) {
+        if (message->length != fixed)
+            return 0;
+        *sequence = seq;
+        memcpy(data, message->data, fixed);
+        return fixed;
+    }
+    *sequence = seq;
+    memcpy(data, message->data, message->length);
+    return message->length;
+}
+
+// slot_copy_to_user: Copies a message snapshot of a slot's channel to a user buffer of
+// the given length. Returns the number of bytes copied, or an appropriate error code.
+static __always_inline ssize_t slot_copy_to_user(struct slot* slot, char __user* buffer, size_t length,
+                                                 const char* data, size_t message_length) {
+    u64 start;
+
+    if (length < message_length) {
+        return -ENOSPC;
+    }
+
+    // Copy the message to user space
+    start = lat_start();
+    if (copy_to_user(buffer, data, message_length)) {
+        return -EFAULT;
+    }
+    lat_record(slot, LAT_READ_COPY, start);
+    return message_length;
+}
+
+// channel_fetch: Takes the last written message of a channel for a reader. An inline
+// message is snapshotted into data under rcu_read_lock only, so readers never block each
+// other or writers and write no shared state; a large message is pinned with a reference
+// stored in *pinned, to be copied straight from its buffer and put by the caller. If the
+// channel is still empty, the call fails with -EWOULDBLOCK when nonblock is set and sleeps
+// until a write otherwise (failing with -EIDRM if the channel is deleted meanwhile).
+// Returns the message length, storing the channel's sequence in *sequence, or an error code.
+static ssize_t channel_fetch(channel_t* channel, char* data, message_t** pinned, u64* sequence, int nonblock) {
+    message_t* message;
+    size_t message_length = 0;
+
+    *pinned = NULL;
+    for (;;) {
+        rcu_read_lock();
+        *sequence = channel_sequence(channel);
+        message = rcu_dereference(channel->message);
+        if (message && !message->large) {
+            message_length = message->length;
+            memcpy(data, message->data, message_length);
+        } else if (message && refcount_inc_not_zero(&message->refs)) {
+            *pinned = message;
+            message_length = message->length;
+        } else if (message) {
+            // Retired under us, so a newer message has been published
+            rcu_read_unlock();
+            continue;
+        }
+        rcu_read_unlock();
+
+        if (message_length != 0) {
+            break;
+        }
+        if (nonblock) {
+            return -EWOULDBLOCK;
+        }
+        if (READ_ONCE(channel->dead)) {
+            return -EIDRM;
+        }
+        if (wait_event_interruptible(channel->wait,
+                                     rcu_access_pointer(channel->message) != NULL || READ_ONCE(channel->dead))) {
+            return -ERESTARTSYS;
+        }
+    }
+    return message_length;
+}
+
+// channel_read_message: Reads the last written message of a channel into a user buffer, or
+// consumes the oldest queued one in queue mode. Blocks on an empty channel as described for
+// channel_fetch. On success the sequence of the message read is stored in *seen, if given.
+// Returns the number of bytes read, or an appropriate error code.
+static ssize_t channel_read_message(channel_t* channel, char __user* buffer, size_t length, int nonblock,
+                                    u64* seen) {
+    message_t* pinned;
+    char data[MAX_MESSAGE_LENGTH];
+    size_t message_length;
+    u64 sequence = 0;
+    ssize_t rc;
+
+    if (rcu_access_pointer(channel->queue)) {
+        rc = channel_dequeue(channel, buffer, length, nonblock);
+        if (rc != -ENOENT) {
+            return rc;
+        }
+    }
+
+    rc = channel_fetch(channel, data, &pinned, &sequence, nonblock);
+    if (rc < 0) {
+        return rc;
+    }
+    message_length = rc;
+
+    if (pinned) {
+        rc = message_length;
+        if (length < message_length)
+            rc = -ENOSPC;
+        else if (copy_to_user(buffer, pinned->data, message_length))
+            rc = -EFAULT;
+        message_put(pinned);
+        if (rc > 0 && seen)
+            *seen = sequence;
+        return rc;
+    }
+
+    rc = slot_copy_to_user(channel->slot, buffer, length, data, message_length);
+    if (rc > 0 && seen)
+        *seen = sequence;
+    return rc;
+}
+
+// channel_read_iter: Like channel_read_message, for a reader's iov_iter (a readv() vector
+// or the pages of a pipe being spliced into), which must have room for the whole message
+static ssize_t channel_read_iter(channel_t* channel, struct iov_iter* to, int nonblock, u64* seen) {
+    size_t length = iov_iter_count(to);
+    message_t* message;
+    message_t* pinned;
+    char data[MAX_MESSAGE_LENGTH];
+    const char* payload = data;
+    size_t message_length;
+    u64 sequence = 0;
+    u64 start;
+    ssize_t rc;
+
+    if (rcu_access_pointer(channel->queue)) {
+        message = channel_pop(channel, length, nonblock);
+        if (!IS_ERR(message)) {
+            rc = message->length;
+            if (copy_to_iter(message->data, message->length, to) != message->length)
+                rc = -EFAULT;
+            message_put(message);
+            return rc;
+        }
+        if (PTR_ERR(message) != -ENOENT) {
+            return PTR_ERR(message);
+        }
+    }
+
+    rc = channel_fetch(channel, data, &pinned, &sequence, nonblock);
+    if (rc < 0) {
+        return rc;
+    }
+    message_length = rc;
+    if (pinned)
+        payload = pinned->data;
+
+    if (length < message_length) {
+        rc = -ENOSPC;
+    } else {
+        start = lat_start();
+        if (copy_to_iter(payload, message_length, to) != message_length)
+            rc = -EFAULT;
+        else
+            lat_record(channel->slot, LAT_READ_COPY, start);
+    }
+    if (pinned)
+        message_put(pinned);
+    if (rc > 0 && seen)
+        *seen = sequence;
+    return rc;
+}
+
+// channel_write: Writes a message to a channel, accounting the outcome in the slot statistics
+static __always_inline ssize_t channel_write(channel_t* channel, const char __user* buffer, size_t length,
+                                             int censor, int nonblock) {
+    ssize_t rc = channel_write_message(channel, buffer, length, censor, nonblock);
+
+    if (rc > 0) {
+        slot_stat_inc(channel->slot, writes);
+        slot_stat_add(channel->slot, bytes_written, rc);
+    } else if (rc == -EMSGSIZE) {
+        slot_stat_inc(channel->slot, write_too_big);
+    }
+    return rc;
+}
+
+// slot_account_read: Accounts the outcome of a read in the slot statistics
+static void slot_account_read(struct slot* slot, ssize_t rc) {
+    if (rc > 0) {
+        slot_stat_inc(slot, reads);
+        slot_stat_add(slot, bytes_read, rc);
+    } else if (rc == -EWOULDBLOCK) {
+        slot_stat_inc(slot, read_empty);
+    }
+}
+
+// channel_read: Reads a message from a channel, accounting the outcome in the slot statistics
+static ssize_t channel_read(channel_t* channel, char __user* buffer, size_t length, int nonblock, u64* seen) {
+    ssize_t rc = channel_read_message(channel, buffer, length, nonblock, seen);
+
+    slot_account_read(channel->slot, rc);
+    return rc;
+}
+
+// slot_free_rcu: Frees a slot once no RCU reader can still see it
+static void slot_free_rcu(struct rcu_head* rcu) {
+    slot_t* slot = container_of(rcu, slot_t, rcu);
+
+    free_percpu(slot->stats);
+    free_percpu(slot->latency);
+    percpu_counter_destroy(&slot->memory);
+    kmem_cache_free(slot_cache, slot);
+}
+
+// slot_stats_show: Prints the statistics of a slot, summed over all CPUs
+static int slot_stats_show(struct seq_file* m, void* unused) {
+    slot_t* slot = m->private;
+    slot_stats_t sum = { 0 };
+    slot_stats_t* cpu_stats;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(slot->stats, cpu);
+        sum.opens += READ_ONCE(cpu_stats->opens);
+        sum.reads += READ_ONCE(cpu_stats->reads);
+        sum.writes += READ_ONCE(cpu_stats->writes);
+        sum.read_empty += READ_ONCE(cpu_stats->read_empty);
+        sum.write_too_big += READ_ONCE(cpu_stats->write_too_big);
+        sum.bytes_read += READ_ONCE(cpu_stats->bytes_read);
+        sum.bytes_written += READ_ONCE(cpu_stats->bytes_written);
+        sum.channels_created += READ_ONCE(cpu_stats->channels_created);
+        sum.channels_deleted += READ_ONCE(cpu_stats->channels_deleted);
+        sum.channels_reaped += READ_ONCE(cpu_stats->channels_reaped);
+        sum.lookups_cached += READ_ONCE(cpu_stats->lookups_cached);
+        sum.lookups_index += READ_ONCE(cpu_stats->lookups_index);
+        sum.dedup_hits += READ_ONCE(cpu_stats->dedup_hits);
+        sum.throttled += READ_ONCE(cpu_stats->throttled);
+    }
+
+    seq_printf(m, "opens %llu\n", sum.opens);
+    seq_printf(m, "reads %llu\n", sum.reads);
+    seq_printf(m, "writes %llu\n", sum.writes);
+    seq_printf(m, "read_empty %llu\n", sum.read_empty);
+    seq_printf(m, "write_too_big %llu\n", sum.write_too_big);
+    seq_printf(m, "bytes_read %llu\n", sum.bytes_read);
+    seq_printf(m, "bytes_written %llu\n", sum.bytes_written);
+    seq_printf(m, "channels_created %llu\n", sum.channels_created);
+    seq_printf(m, "channels_deleted %llu\n", sum.channels_deleted);
+    seq_printf(m, "channels_reaped %llu\n", sum.channels_reaped);
+    seq_printf(m, "lookups_cached %llu\n", sum.lookups_cached);
+    seq_printf(m, "lookups_index %llu\n", sum.lookups_index);
+    seq_printf(m, "dedup_hits %llu\n", sum.dedup_hits);
+    seq_printf(m, "throttled %llu\n", sum.throttled);
+    seq_printf(m, "memory_bytes %lld\n", percpu_counter_sum(&slot->memory));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(slot_stats);
+
+// slot_latency_show: Prints the non-empty buckets of a slot's latency histograms,
+// summed over all CPUs, as "<upper bound in ns> <count>" lines per phase
+static int slot_latency_show(struct seq_file* m, void* unused) {
+    slot_t* slot = m->private;
+    u64 count;
+    int phase, bucket, cpu;
+
+    for (phase = 0; phase < LAT_PHASES; phase++) {
+        seq_printf(m, "%s:\n", lat_phase_names[phase]);
+        for (bucket = 0; bucket < LAT_BUCKETS; bucket++) {
+            count = 0;
+            for_each_possible_cpu(cpu) {
+                count += READ_ONCE(per_cpu_ptr(slot->latency, cpu)->buckets[phase][bucket]);
+            }
+            if (count)
+                seq_printf(m, "  %llu %llu\n", 1ULL << bucket, count);
+        }
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(slot_latency);
+
+// snapshot_find: Returns the first live channel of a slot with an id of at least *pos,
+// with a reference held, storing its id in *pos. Returns NULL past the last channel.
+static channel_t* snapshot_find(slot_t* slot, loff_t* pos) {
+    channel_t* channel;
+    unsigned long id;
+
+    if (*pos > UINT_MAX) {
+        return NULL;
+    }
+    rcu_read_lock();
+    xa_for_each_start(&slot->channels, id, channel, (unsigned long) *pos) {
+        if (kref_get_unless_zero(&channel->refcount))
+            break;
+    }
+    rcu_read_unlock();
+    if (channel)
+        *pos = id;
+    return channel;
+}
+
+// The snapshot file is positioned at 0 for its header and at a channel id for the channel
+// records, so a read resumes at the next channel even if channels came and went meanwhile
+static void* slot_snapshot_start(struct seq_file* m, loff_t* pos) {
+    if (*pos == 0)
+        return SEQ_START_TOKEN;
+    return snapshot_find(m->private, pos);
+}
+
+static void* slot_snapshot_next(struct seq_file* m, void* v, loff_t* pos) {
+    if (v != SEQ_START_TOKEN) {
+        *pos = ((channel_t*) v)->id;
+        channel_put(v);
+    }
+    ++*pos;
+    return snapshot_find(m->private, pos);
+}
+
+static void slot_snapshot_stop(struct seq_file* m, void* v) {
+    if (v && v != SEQ_START_TOKEN)
+        channel_put(v);
+}
+
+// slot_snapshot_show: Emits the snapshot header, or the record and last message of a channel
+static int slot_snapshot_show(struct seq_file* m, void* v) {
+    static const char padding[MSG_SLOT_RECORD_ALIGN];
+    slot_t* slot = m->private;
+    struct msg_slot_snapshot_header header = {
+        .magic = MSG_SLOT_SNAPSHOT_MAGIC,
+        .version = MSG_SLOT_SNAPSHOT_VERSION,
+    };
+    struct msg_slot_record record;
+    channel_t* channel = v;
+    message_t* pinned;
+    char data[MAX_MESSAGE_LENGTH];
+    u64 sequence;
+    ssize_t rc;
+
+    if (v == SEQ_START_TOKEN) {
+        header.max_message_length = READ_ONCE(slot->max_message_length);
+        seq_write(m, &header, sizeof(header));
+        return 0;
+    }
+    if (READ_ONCE(channel->dead) || rcu_access_pointer(channel->queue)) {
+        return 0;
+    }
+    rc = channel_fetch(channel, data, &pinned, &sequence, 1);
+    if (rc < 0) {
+        return 0;   // Empty
+    }
+
+    record.channel_id = channel->id;
+    record.length = rc;
+    seq_write(m, &record, sizeof(record));
+    seq_write(m, pinned ? pinned->data : data, record.length);
+    seq_write(m, padding, ALIGN(sizeof(record) + record.length, MSG_SLOT_RECORD_ALIGN) - sizeof(record) -
+                          record.length);
+    if (pinned)
+        message_put(pinned);
+    return 0;
+}
+
+static const struct seq_operations slot_snapshot_sops = {
+    .start = slot_snapshot_start,
+    .next = slot_snapshot_next,
+    .stop = slot_snapshot_stop,
+    .show = slot_snapshot_show,
+};
+DEFINE_SEQ_ATTRIBUTE(slot_snapshot);
+
+// slot_release: Frees a slot and drops the index references of all its channels
+static void slot_release(struct kref* kref) {
+    slot_t* slot = container_of(kref, slot_t, refcount);
+    channel_t* channel;
+    unsigned long id;
+
+    xa_for_each(&slot->channels, id, channel) {
+        channel_put(channel);
+    }
+    xa_destroy(&slot->channels);
+    ida_destroy(&slot->mmap_ida);
+    debugfs_remove_recursive(slot->debugfs_dir);   // Waits for open stats files to be done
+    vfree(slot->mmap_area);   // No mapping can outlive the fds, which held references
+    call_rcu(&slot->rcu, slot_free_rcu);
+}
+
+static void slot_put(slot_t* slot) {
+    kref_put(&slot->refcount, slot_release);
+}
+
+// slot_find_channel: Looks up the channel with the given id in a slot without creating it.
+// Returns the channel with a reference held for the caller, or NULL if it does not exist.
+static channel_t* slot_find_channel(slot_t* slot, unsigned int id) {
+    channel_t* channel;
+    u64 start = lat_start();
+
+    slot_stat_inc(slot, lookups_index);
+    rcu_read_lock();
+    channel = xa_load(&slot->channels, id);
+    if (channel && !kref_get_unless_zero(&channel->refcount)) {
+        channel = NULL;
+    }
+    rcu_read_unlock();
+    lat_record(slot, LAT_LOOKUP, start);
+    return channel;
+}
+
+// slot_get_channel: Looks up the channel with the given id in a slot, creating it if needed.
+// Returns the channel with a reference held for the caller, or NULL on allocation failure.
+static channel_t* slot_get_channel(slot_t* slot, unsigned int id) {
+    channel_t* channel = slot_find_channel(slot, id);
+    int index;
+
+    if (channel) {
+        return channel;
+    }
+
+    // Re-check under the slot lock so that racing creators end up sharing one channel
+    mutex_lock(&slot->lock);
+    channel = xa_load(&slot->channels, id);
+    if (!channel) {
+        channel = kmem_cache_alloc_node(channel_cache, GFP_KERNEL, READ_ONCE(slot->node));
+        if (!channel)
+            goto out;
+        channel->id = id;
+        kref_init(&channel->refcount);   // Reference owned by the slot's channel index
+        channel->slot = slot;
+        spin_lock_init(&channel->lock);
+        RCU_INIT_POINTER(channel->message, NULL);
+        channel->sequence = 0;
+        init_waitqueue_head(&channel->wait);
+        RCU_INIT_POINTER(channel->queue, NULL);
+        init_waitqueue_head(&channel->space_wait);
+        channel->spare = NULL;
+        channel->dead = false;
+        channel->memory = sizeof(channel_t);
+        channel->last_write = jiffies;
+        rate_limit_init(&channel->rate);
+        channel->mmap_entry = NULL;
+        if (slot->mmap_area) {
+            index = ida_alloc_max(&slot->mmap_ida, mmap_channels - 1, GFP_KERNEL);
+            if (index >= 0) {
+                channel->mmap_entry = &slot->mmap_area[index];
+                mirror_assign(channel->mmap_entry, id);
+            }
+        }
+        if (xa_err(xa_store(&slot->channels, id, channel, GFP_KERNEL))) {
+            if (channel->mmap_entry) {
+                mirror_assign(channel->mmap_entry, 0);
+                ida_free(&slot->mmap_ida, channel->mmap_entry - slot->mmap_area);
+            }
+            kmem_cache_free(channel_cache, channel);
+            channel = NULL;
+            goto out;
+        }
+        percpu_counter_add(&slot->memory, channel->memory);
+        spin_lock(&slot->lru_lock);
+        list_add_tail(&channel->lru_node, &slot->lru);
+        spin_unlock(&slot->lru_lock);
+        slot_stat_inc(slot, channels_created);
+    }
+    kref_get(&channel->refcount);
+out:
+    mutex_unlock(&slot->lock);
+    return channel;
+}
+
+// fd_relay_wake: Wake function of the fd's relay entries on its selected channel's wait
+// queues, forwarding the wake-up to the fd's pollers
+static int fd_relay_wake(wait_queue_entry_t* wait, unsigned int mode, int sync, void* key) {
+    wait_queue_head_t* poll_wait = wait->private;
+
+    if (wq_has_sleeper(poll_wait))
+        wake_up_interruptible(poll_wait);
+    return 0;
+}
+
+// fd_attach_relays: Registers the fd's relays on the wait queues of its selected channel,
+// unless they already sit there or the channel was reselected meanwhile
+static void fd_attach_relays(fd_state_t* state, channel_t* channel) {
+    spin_lock(&state->lock);
+    if (!state->relay_channel && rcu_access_pointer(state->channel) == channel) {
+        add_wait_queue(&channel->wait, &state->read_relay);
+        add_wait_queue(&channel->space_wait, &state->space_relay);
+        state->relay_channel = channel;
+    }
+    spin_unlock(&state->lock);
+}
+
+// fd_detach_relays: Removes the fd's relays from the channel they sit on. Called with the
+// fd lock held, before the fd's reference on that channel is dropped.
+static void fd_detach_relays(fd_state_t* state) {
+    channel_t* channel = state->relay_channel;
+
+    if (channel) {
+        remove_wait_queue(&channel->wait, &state->read_relay);
+        remove_wait_queue(&channel->space_wait, &state->space_relay);
+        state->relay_channel = NULL;
+    }
+}
+
+// slot_delete_channel: Deletes a channel, referenced by the caller, from its slot: unlinks it
+// from the index and the LRU list, marks it dead, uncharges its memory, clears and frees its
+// mmap entry and wakes its blocked readers and writers so that they move to a new channel.
+// The channel itself is freed once the fds still holding it drop it.
+// Returns -ENOENT if the channel was already deleted.
+static int slot_delete_channel(slot_t* slot, channel_t* channel) {
+    struct msg_slot_mmap_entry* entry;
+
+    mutex_lock(&slot->lock);
+    if (xa_load(&slot->channels, channel->id) != channel) {
+        mutex_unlock(&slot->lock);
+        return -ENOENT;
+    }
+    xa_erase(&slot->channels, channel->id);
+    spin_lock(&slot->lru_lock);
+    list_del_init(&channel->lru_node);
+    spin_unlock(&slot->lru_lock);
+
+    // Writers check dead and the mmap entry under the channel lock
+    spin_lock(&channel->lock);
+    WRITE_ONCE(channel->dead, true);
+    percpu_counter_sub(&slot->memory, channel->memory);
+    entry = channel->mmap_entry;
+    channel->mmap_entry = NULL;
+    if (entry)
+        mirror_assign(entry, 0);
+    spin_unlock(&channel->lock);
+    if (entry)
+        ida_free(&slot->mmap_ida, entry - slot->mmap_area);
+    mutex_unlock(&slot->lock);
+
+    wake_up_interruptible_all(&channel->wait);
+    wake_up_interruptible_all(&channel->space_wait);
+    channel_put(channel);   // The index's reference
+    return 0;
+}
+
+// slot_reap: Deletes the channels of a slot not written within the TTL, then the least
+// recently written ones for as long as the slot is over its memory cap
+static void slot_reap(slot_t* slot) {
+    unsigned long ttl = READ_ONCE(channel_ttl_secs) * (unsigned long) HZ;
+    long cap = READ_ONCE(slot_memory_cap_kb) * 1024L;
+    channel_t* channel;
+
+    for (;;) {
+        spin_lock(&slot->lru_lock);
+        channel = list_first_entry_or_null(&slot->lru, channel_t, lru_node);
+        if (channel && !(cap && percpu_counter_compare(&slot->memory, cap) > 0) &&
+            !(ttl && time_after_eq(jiffies, READ_ONCE(channel->last_write) + ttl))) {
+            channel = NULL;
+        }
+        if (channel)
+            kref_get(&channel->refcount);   // Still indexed while on the list
+        spin_unlock(&slot->lru_lock);
+        if (!channel)
+            break;
+
+        if (slot_delete_channel(slot, channel) == 0)
+            slot_stat_inc(slot, channels_reaped);
+        channel_put(channel);
+        cond_resched();
+    }
+}
 
-// Represents a device slot identified by a minor number, containing linked channels
-typedef struct slot {
+// reaper_work_fn: Reaps every slot. Runs every REAPER_PERIOD while the TTL is enabled, and
+// right away when a slot goes over its memory cap.
+static void reaper_work_fn(struct work_struct* work) {
+    slot_t* slot;
     int minor;
-    channel_t* channels;
-    struct slot* next;
-} slot_t;
 
-// Represents the state of an open file descriptor, including selected channel and censorship flag
-typedef struct {
-    unsigned int channel_id;
-    int censorship_enabled;
-} fd_state_t;
+    atomic_set(&reaper_urgent, 0);
+    for (minor = 0; minor < SLOT_TABLE_SIZE; minor++) {
+        rcu_read_lock();
+        slot = rcu_dereference(slot_table[minor]);
+        if (slot && !kref_get_unless_zero(&slot->refcount)) {
+            slot = NULL;
+        }
+        rcu_read_unlock();
+        if (slot) {
+            slot_reap(slot);
+            slot_put(slot);
+        }
+    }
+    if (READ_ONCE(channel_ttl_secs) && READ_ONCE(reaper_enabled))
+        queue_delayed_work(system_wq, &reaper_work, REAPER_PERIOD);
+}
+
+// fd_set_channel: Makes a channel, referenced by the caller, the fd's selected channel and
+// drops the fd's reference on the previous one, which RCU keeps alive for threads still
+// using it through the fd
+static void fd_set_channel(fd_state_t* state, channel_t* channel) {
+    channel_t* old;
+
+    spin_lock(&state->lock);
+    fd_detach_relays(state);
+    old = rcu_replace_pointer(state->channel, channel, lockdep_is_held(&state->lock));
+    state->channel_id = channel->id;
+    state->last_seen = 0;
+    spin_unlock(&state->lock);
+    if (old)
+        channel_put(old);
+    // Let pollers registered before the reselect report the new channel
+    wake_up_interruptible(&state->poll_wait);
+}
+
+// fd_get_channel: Returns the fd's selected channel with a reference held for the caller,
+// first replacing it with a new channel of the same id if it was deleted.
+// Returns ERR_PTR(-EINVAL) if no channel is selected, or ERR_PTR(-ENOMEM).
+static channel_t* fd_get_channel(fd_state_t* state) {
+    channel_t* channel;
+    channel_t* fresh;
+    bool replaced;
+
+    for (;;) {
+        rcu_read_lock();
+        channel = rcu_dereference(state->channel);
+        if (channel && !kref_get_unless_zero(&channel->refcount)) {
+            // Replaced and dropped under us, so the fd already points at the replacement
+            rcu_read_unlock();
+            continue;
+        }
+        rcu_read_unlock();
+        if (!channel) {
+            return ERR_PTR(-EINVAL);
+        }
+        if (likely(!READ_ONCE(channel->dead))) {
+            return channel;
+        }
+
+        fresh = slot_get_channel(state->slot, channel->id);
+        spin_lock(&state->lock);
+        replaced = fresh && rcu_access_pointer(state->channel) == channel;
+        if (replaced) {
+            fd_detach_relays(state);
+            rcu_assign_pointer(state->channel, fresh);   // Takes over the reference on fresh
+            state->last_seen = 0;
+        }
+        spin_unlock(&state->lock);
+        if (replaced) {
+            channel_put(channel);   // The fd's reference on the dead channel
+            // Pollers move their relays to the new channel on their next poll
+            wake_up_interruptible(&state->poll_wait);
+        } else if (fresh) {
+            channel_put(fresh);     // Another thread replaced it first
+        }
+        channel_put(channel);
+        if (!fresh) {
+            return ERR_PTR(-ENOMEM);
+        }
+    }
+}
+
+// fd_find_channel: Returns the fd's selected channel with a reference held for the caller,
+// like fd_get_channel but without sleeping: a channel that was deleted is not replaced.
+// Returns ERR_PTR(-EINVAL) if no channel is selected, or ERR_PTR(-EAGAIN) if it is dead.
+static channel_t* fd_find_channel(fd_state_t* state) {
+    channel_t* channel;
+
+    rcu_read_lock();
+    channel = rcu_dereference(state->channel);
+    if (channel && (READ_ONCE(channel->dead) || !kref_get_unless_zero(&channel->refcount))) {
+        channel = ERR_PTR(-EAGAIN);
+    }
+    rcu_read_unlock();
+    return channel ? channel : ERR_PTR(-EINVAL);
+}
+
+// fd_read_selected: Reads the last written message of the fd's selected channel. An inline
+// message is snapshotted through the RCU-protected channel pointer without taking a reference
+// on the channel; every other case, including a message not of the fixed size of a
+// specialized reader, falls back to channel_read on a referenced channel.
+static __always_inline ssize_t fd_read_selected(fd_state_t* state, char __user* buffer, size_t length,
+                                                int nonblock, size_t fixed) {
+    channel_t* channel;
+    char data[MAX_MESSAGE_LENGTH];
+    size_t message_length = 0;
+    u64 sequence = 0;
+    ssize_t rc;
+
+    rcu_read_lock();
+    channel = rcu_dereference(state->channel);
+    if (channel && !READ_ONCE(channel->dead) && !rcu_access_pointer(channel->queue)) {
+        message_length = channel_snapshot(channel, data, &sequence, fixed);
+    }
+    rcu_read_unlock();
+
+    if (message_length != 0) {
+        rc = slot_copy_to_user(state->slot, buffer, length, data, fixed ? fixed : message_length);
+        if (rc > 0)
+            state->last_seen = sequence;
+        slot_account_read(state->slot, rc);
+        return rc;
+    }
+
+    channel = nonblock == NONBLOCK_NOWAIT ? fd_find_channel(state) : fd_get_channel(state);
+    if (IS_ERR(channel)) {
+        return PTR_ERR(channel);
+    }
+    rc = channel_read(channel, buffer, length, nonblock, &state->last_seen);
+    channel_put(channel);
+    return rc;
+}
+
+// subscription_wake: Wake function of a subscription's entry on its channel's wait queue,
+// relaying the wake-up to the subscribed fd
+static int subscription_wake(wait_queue_entry_t* wait, unsigned int mode, int sync, void* key) {
+    subscription_t* sub = container_of(wait, subscription_t, wait);
+
+    if (wq_has_sleeper(sub->fd_wait))
+        wake_up_interruptible(sub->fd_wait);
+    return 0;
+}
+
+// subscription_free_rcu: Frees a subscription once no RCU reader can still see it
+static void subscription_free_rcu(struct rcu_head* rcu) {
+    kmem_cache_free(subscription_cache, container_of(rcu, subscription_t, rcu));
+}
+
+// subscription_drop: Detaches a subscription removed from the fd's index from its
+// channel and frees it after a grace period
+static void subscription_drop(subscription_t* sub) {
+    remove_wait_queue(&sub->channel->wait, &sub->wait);
+    channel_put(sub->channel);
+    call_rcu(&sub->rcu, subscription_free_rcu);
+}
+
+// fd_subscribe: Subscribes an fd to the channel with the given id, creating it if needed
+static long fd_subscribe(fd_state_t* state, unsigned int id) {
+    subscription_t* sub;
+    channel_t* channel;
+    int rc;
+
+    sub = kmem_cache_alloc(subscription_cache, GFP_KERNEL);
+    if (!sub) {
+        return -ENOMEM;
+    }
+    channel = slot_get_channel(state->slot, id);
+    if (!channel) {
+        kmem_cache_free(subscription_cache, sub);
+        return -ENOMEM;
+    }
+    sub->channel = channel;
+    sub->last_seen = 0;        // The current message is reported by the next read
+    sub->fd_wait = &state->sub_wait;
+    init_waitqueue_func_entry(&sub->wait, subscription_wake);
+
+    mutex_lock(&state->sub_lock);
+    if (state->sub_count >= MSG_SLOT_MAX_SUBSCRIPTIONS) {
+        rc = -ENOSPC;
+    } else {
+        rc = xa_insert(&state->subscriptions, id, sub, GFP_KERNEL);
+        if (rc == -EBUSY)
+            rc = -EEXIST;
+    }
+    if (rc == 0) {
+        add_wait_queue(&channel->wait, &sub->wait);
+        state->sub_count++;
+    }
+    mutex_unlock(&state->sub_lock);
+
+    if (rc) {
+        channel_put(channel);
+        kmem_cache_free(subscription_cache, sub);
+        return rc;
+    }
+    // Let a subscription read already waiting pick up the current message
+    wake_up_interruptible(&state->sub_wait);
+    return 0;
+}
+
+// fd_unsubscribe: Removes the subscription of an fd to the channel with the given id
+static long fd_unsubscribe(fd_state_t* state, unsigned int id) {
+    subscription_t* sub;
+
+    mutex_lock(&state->sub_lock);
+    sub = xa_erase(&state->subscriptions, id);
+    if (sub) {
+        state->sub_count--;
+        subscription_drop(sub);
+    }
+    mutex_unlock(&state->sub_lock);
+    return sub ? 0 : -ENOENT;
+}
+
+// subscription_pending: Returns whether a subscription has a message to report, or was
+// deleted and needs to move to a new channel. Called under rcu_read_lock.
+static bool subscription_pending(subscription_t* sub) {
+    channel_t* channel = READ_ONCE(sub->channel);
+
+    return READ_ONCE(channel->dead) ||
+           (!rcu_access_pointer(channel->queue) && READ_ONCE(channel->sequence) != READ_ONCE(sub->last_seen));
+}
+
+// fd_subscriptions_pending: Wait and poll condition of subscription reads
+static bool fd_subscriptions_pending(fd_state_t* state) {
+    subscription_t* sub;
+    unsigned long id;
+    bool pending = false;
+
+    rcu_read_lock();
+    xa_for_each(&state->subscriptions, id, sub) {
+        if (subscription_pending(sub)) {
+            pending = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+    return pending;
+}
+
+// subscription_channel: Returns the channel of a subscription, first moving the subscription
+// to a new channel of the same id if its channel was deleted. Called with the fd's sub_lock held.
+static channel_t* subscription_channel(fd_state_t* state, subscription_t* sub) {
+    channel_t* channel = sub->channel;
+    channel_t* fresh;
+
+    if (likely(!READ_ONCE(channel->dead)))
+        return channel;
+    fresh = slot_get_channel(state->slot, channel->id);
+    if (!fresh)
+        return channel;   // Nothing new to report from the dead channel; retried next read
+    remove_wait_queue(&channel->wait, &sub->wait);
+    add_wait_queue(&fresh->wait, &sub->wait);
+    WRITE_ONCE(sub->channel, fresh);
+    WRITE_ONCE(sub->last_seen, 0);
+    channel_put(channel);   // Freed after a grace period, so concurrent pending checks are safe
+    return fresh;
+}
+
+// subscription_read: Appends the record of a subscription to a user buffer at the given
+// position if its channel was written since the subscription last reported it.
+// Returns the record size, 0 if there is nothing new, -ENOSPC if the record does not
+// fit in the remaining space, or another error code. Called with the fd's sub_lock held.
+static ssize_t subscription_read(fd_state_t* state, subscription_t* sub, char __user* buffer, size_t space) {
+    channel_t* channel = subscription_channel(state, sub);
+    struct msg_slot_record record;
+    message_t* message;
+    message_t* pinned = NULL;
+    char data[MAX_MESSAGE_LENGTH];
+    const char* payload = data;
+    u64 sequence = 0;
+    size_t size;
+    ssize_t rc;
+
+    rcu_read_lock();
+    sequence = channel_sequence(channel);
+    message = rcu_dereference(channel->message);
+    if (!message || rcu_access_pointer(channel->queue) || sequence == sub->last_seen) {
+        message = NULL;
+    } else if (!message->large) {
+        record.length = message->length;
+        memcpy(data, message->data, message->length);
+    } else if (refcount_inc_not_zero(&message->refs)) {
+        pinned = message;
+        payload = pinned->data;
+        record.length = message->length;
+    } else {
+        message = NULL;   // Retired under us; the newer message is picked up next read
+    }
+    rcu_read_unlock();
+    if (!message) {
+        return 0;
+    }
+
+    record.channel_id = channel->id;
+    size = ALIGN(sizeof(record) + record.length, MSG_SLOT_RECORD_ALIGN);
+    if (size > space) {
+        rc = -ENOSPC;
+    } else if (copy_to_user(buffer, &record, sizeof(record)) ||
+               copy_to_user(buffer + sizeof(record), payload, record.length) ||
+               clear_user(buffer + sizeof(record) + record.length, size - sizeof(record) - record.length)) {
+        rc = -EFAULT;
+    } else {
+        WRITE_ONCE(sub->last_seen, sequence);
+        slot_account_read(state->slot, record.length);
+        rc = size;
+    }
+    if (pinned)
+        message_put(pinned);
+    return rc;
+}
+
+// fd_read_subscribed_once: Fills a user buffer with the records of the fd's subscriptions
+// that have news, starting at sub_cursor and wrapping around. Returns the number of
+// bytes filled, 0 if there was nothing new, or an error code if no record was returned.
+static ssize_t fd_read_subscribed_once(fd_state_t* state, char __user* buffer, size_t length) {
+    subscription_t* sub;
+    unsigned long start = state->sub_cursor;
+    unsigned long id;
+    size_t done = 0;
+    ssize_t rc = 0;
+    int pass;
+
+    // First the ids from the cursor on, then those before it
+    for (pass = 0; pass < 2; pass++) {
+        xa_for_each_range(&state->subscriptions, id, sub, pass ? 0 : start, pass ? start - 1 : ULONG_MAX) {
+            rc = subscription_read(state, sub, buffer + done, length - done);
+            if (rc < 0) {
+                state->sub_cursor = id;   // Resume with this channel
+                return done ? done : rc;
+            }
+            done += rc;
+            cond_resched();
+        }
+        if (start == 0)
+            break;
+    }
+    return done;
+}
+
+// fd_read_subscribed: Handles a read in the MSG_SLOT_READ_SUBSCRIBED mode, blocking until
+// a subscribed channel has news unless nonblock is set
+static ssize_t fd_read_subscribed(fd_state_t* state, char __user* buffer, size_t length, int nonblock) {
+    ssize_t rc;
+
+    // Subscription reads take the subscription mutex and may recreate deleted channels
+    if (nonblock == NONBLOCK_NOWAIT) {
+        return -EAGAIN;
+    }
+    for (;;) {
+        mutex_lock(&state->sub_lock);
+        rc = fd_read_subscribed_once(state, buffer, length);
+        mutex_unlock(&state->sub_lock);
+
+        if (rc != 0) {
+            return rc;
+        }
+        if (nonblock) {
+            slot_stat_inc(state->slot, read_empty);
+            return -EWOULDBLOCK;
+        }
+        if (wait_event_interruptible(state->sub_wait, fd_subscriptions_pending(state))) {
+            return -ERESTARTSYS;
+        }
+    }
+}
+
+// fd_write_selected: Writes a message through a fd to its selected channel. Inlined into
+// the write handlers with censor (and, for the fixed-size ones, length) as constants.
+static __always_inline ssize_t fd_write_selected(fd_state_t* state, const char __user* buffer, size_t length,
+                                                 int censor, int nonblock) {
+    channel_t* channel;
+    ssize_t rc;
+
+    slot_stat_inc(state->slot, lookups_cached);
+
+    // A writer blocked on a channel that gets deleted retries on its replacement
+    do {
+        channel = nonblock == NONBLOCK_NOWAIT ? fd_find_channel(state) : fd_get_channel(state);
+        if (IS_ERR(channel)) {
+            return PTR_ERR(channel);
+        }
+        rc = writer_admit(state->slot, &state->rate, &channel->rate, nonblock);
+        if (rc == 0) {
+            rc = channel_write(channel, buffer, length, censor, nonblock);
+            if (rc < 0)
+                writer_refund(&state->rate, &channel->rate);
+        }
+        channel_put(channel);
+    } while (rc == -EIDRM);
+    return rc;
+}
+
+// Generic handlers of the selected channel, for messages of any size
+static ssize_t fd_write_plain(fd_state_t* state, const char __user* buffer, size_t length, int nonblock) {
+    return fd_write_selected(state, buffer, length, 0, nonblock);
+}
+
+static ssize_t fd_write_censored(fd_state_t* state, const char __user* buffer, size_t length, int nonblock) {
+    return fd_write_selected(state, buffer, length, 1, nonblock);
+}
+
+static ssize_t fd_read_any(fd_state_t* state, char __user* buffer, size_t length, int nonblock) {
+    return fd_read_selected(state, buffer, length, nonblock, 0);
+}
+
+// DEFINE_FD_HANDLERS: Defines the plain and censored write handlers and the read handler of
+// the selected channel for messages of exactly size bytes, whose copies and censoring then
+// compile to straight-line code. Writes of any other size take the generic handlers.
+#define DEFINE_FD_HANDLERS(size)                                                                          \
+    static ssize_t fd_write_plain_##size(fd_state_t* state, const char __user* buffer, size_t length,      \
+                                         int nonblock) {                                                   \
+        if (length != size)                                                                                \
+            return fd_write_plain(state, buffer, length, nonblock);                                        \
+        return fd_write_selected(state, buffer, size, 0, nonblock);                                        \
+    }                                                                                                      \
+    static ssize_t fd_write_censored_##size(fd_state_t* state, const char __user* buffer, size_t length,   \
+                                            int nonblock) {                                                \
+        if (length != size)                                                                                \
+            return fd_write_censored(state, buffer, length, nonblock);                                     \
+        return fd_write_selected(state, buffer, size, 1, nonblock);                                        \
+    }                                                                                                      \
+    static ssize_t fd_read_##size(fd_state_t* state, char __user* buffer, size_t length, int nonblock) {    \
+        return fd_read_selected(state, buffer, length, nonblock, size);                                    \
+    }
+
+DEFINE_FD_HANDLERS(8)
+DEFINE_FD_HANDLERS(16)
+DEFINE_FD_HANDLERS(64)
+DEFINE_FD_HANDLERS(128)
+
+// Handlers by the message size they are specialized for, 0 being the generic ones
+static const struct {
+    unsigned int size;
+    fd_write_fn write[2];   // Indexed by censorship mode
+    fd_read_fn read;
+} fd_handlers[] = {
+    { 0, { fd_write_plain, fd_write_censored }, fd_read_any },
+    { 8, { fd_write_plain_8, fd_write_censored_8 }, fd_read_8 },
+    { 16, { fd_write_plain_16, fd_write_censored_16 }, fd_read_16 },
+    { 64, { fd_write_plain_64, fd_write_censored_64 }, fd_read_64 },
+    { 128, { fd_write_plain_128, fd_write_censored_128 }, fd_read_128 },
+};
+
+// fd_handlers_index: Returns the index in fd_handlers of the handlers for a fixed message
+// size, or -1 if there are none
+static int fd_handlers_index(unsigned int size) {
+    int i;
 
-// Global linked list head for all device slots currently in use
-static slot_t* slot_list_head = NULL;
+    for (i = 0; i < (int) ARRAY_SIZE(fd_handlers); i++) {
+        if (fd_handlers[i].size == size)
+            return i;
+    }
+    return -1;
+}
+
+// fd_select_handlers: Points the fd's handlers at the variants for its censorship mode,
+// fixed message size and read mode. Called whenever one of them changes.
+static void fd_select_handlers(fd_state_t* state) {
+    int i = fd_handlers_index(state->fixed_size);
+
+    WRITE_ONCE(state->write, fd_handlers[i].write[state->censorship_enabled]);
+    WRITE_ONCE(state->read, state->read_mode == MSG_SLOT_READ_SUBSCRIBED ? fd_read_subscribed : fd_handlers[i].read);
+}
 
 // Function prototypes for file operations
 // Called when device file is opened
@@ -44,8 +2266,21 @@ static int device_open(struct inode* inode, struct file* file);
 static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset);
 // Called when data is written to device
 static ssize_t device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset);
+// Called by readv() and splice()/sendfile() from the device
+static ssize_t device_read_iter(struct kiocb* iocb, struct iov_iter* to);
+// Called by writev() and splice() into the device
+static ssize_t device_write_iter(struct kiocb* iocb, struct iov_iter* from);
+// Called by splice()/sendfile() from the device
+static ssize_t device_splice_read(struct file* in, loff_t* ppos, struct pipe_inode_info* pipe, size_t len,
+                                  unsigned int flags);
+// Called for IORING_OP_URING_CMD submissions on the device
+static int device_uring_cmd(struct io_uring_cmd* ioucmd, unsigned int issue_flags);
 // Called for ioctl commands on the device
 static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param);
+// Called when the device is memory mapped
+static int device_mmap(struct file* file, struct vm_area_struct* vma);
+// Called by poll/select/epoll
+static __poll_t device_poll(struct file* file, poll_table* wait);
 
 // File operations structure linking to implemented functions
 static int device_release(struct inode* inode, struct file* file);
@@ -54,81 +2289,596 @@ static struct file_operations fops = {
     .open = device_open,
     .read = device_read,
     .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+    .splice_read = device_splice_read,
+    .splice_write = iter_file_splice_write,
+    .uring_cmd = device_uring_cmd,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
+    .poll = device_poll,
     .release = device_release,
 };
 // device_release: Frees per-file descriptor state when device is closed
+// and releases its references on the cached slot and channel
 static int device_release(struct inode* inode, struct file* file) {
+    fd_state_t* state;
+    channel_t* channel;
+    subscription_t* sub;
+    unsigned long id;
+
     if (file && file->private_data) {
-        kfree(file->private_data);
+        state = (fd_state_t*) file->private_data;
+        spin_lock(&state->lock);
+        fd_detach_relays(state);
+        spin_unlock(&state->lock);
+        xa_for_each(&state->subscriptions, id, sub) {
+            subscription_drop(sub);
+        }
+        xa_destroy(&state->subscriptions);
+        channel = rcu_dereference_protected(state->channel, 1);
+        if (channel)
+            channel_put(channel);
+        slot_put(state->slot);
+        kmem_cache_free(fd_state_cache, state);
         file->private_data = NULL;
     }
-    return 0;
+    return 0;
+}
+
+// destroy_caches: Destroys the slab caches; safe to call with caches that were never created
+static void destroy_caches(void) {
+    kmem_cache_destroy(subscription_cache);
+    kmem_cache_destroy(fd_state_cache);
+    kmem_cache_destroy(slot_cache);
+    kmem_cache_destroy(channel_cache);
+    kmem_cache_destroy(message_cache);
+}
+
+// Module initialization function: creates the slab caches and registers the character device
+static int __init message_slot_init(void) {
+    int rc;
+
+    if (max_message_length == 0 || max_message_length > MSG_SLOT_MAX_LARGE_LENGTH) {
+        printk(KERN_ERR "message_slot: invalid max_message_length %u\n", max_message_length);
+        return -EINVAL;
+    }
+    censor_init_masks();
+
+    message_cache = kmem_cache_create("message_slot_message", sizeof(message_t) + MAX_MESSAGE_LENGTH, 0,
+                                      SLAB_HWCACHE_ALIGN, NULL);
+    channel_cache = kmem_cache_create("message_slot_channel", sizeof(channel_t), __alignof__(channel_t),
+                                      SLAB_HWCACHE_ALIGN, NULL);
+    slot_cache = kmem_cache_create("message_slot_slot", sizeof(slot_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+    fd_state_cache = kmem_cache_create("message_slot_fd_state", sizeof(fd_state_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+    subscription_cache = kmem_cache_create("message_slot_subscription", sizeof(subscription_t), 0, 0, NULL);
+    if (!message_cache || !channel_cache || !slot_cache || !fd_state_cache || !subscription_cache) {
+        printk(KERN_ERR "message_slot: failed to create slab caches\n");
+        destroy_caches();
+        return -ENOMEM;
+    }
+
+    debugfs_root = debugfs_create_dir(DEVICE_RANGE_NAME, NULL);
+
+    rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &fops);
+    if (rc < 0) {
+        printk(KERN_ERR "message_slot: failed to register device\n");
+        debugfs_remove_recursive(debugfs_root);
+        destroy_caches();
+        return rc;
+    }
+    WRITE_ONCE(reaper_enabled, true);
+    if (channel_ttl_secs)
+        reaper_kick();
+    printk(KERN_INFO "message_slot: module loaded\n");
+    return 0;
+}
+
+// Module cleanup function: stops the reaper, unregisters the character device, frees every
+// slot (and with it every channel and message) and destroys the slab caches.
+// No fd can be open at this point, so the slot table holds the last slot references.
+static void __exit message_slot_cleanup(void) {
+    slot_t* slot;
+    int minor;
+
+    WRITE_ONCE(reaper_enabled, false);
+    cancel_delayed_work_sync(&reaper_work);
+    unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+    for (minor = 0; minor < SLOT_TABLE_SIZE; minor++) {
+        slot = rcu_dereference_protected(slot_table[minor], 1);
+        if (slot) {
+            RCU_INIT_POINTER(slot_table[minor], NULL);
+            slot_put(slot);
+        }
+    }
+    // Wait for all pending RCU frees before destroying their caches: the second barrier
+    // covers the messages put by channel frees that the first one waited for
+    rcu_barrier();
+    rcu_barrier();
+    debugfs_remove_recursive(debugfs_root);
+    destroy_caches();
+    printk(KERN_INFO "message_slot: module unloaded\n");
+}
+
+module_init(message_slot_init);
+module_exit(message_slot_cleanup);
+
+// numa_node_valid: Returns whether node names an online NUMA node, or is NUMA_NO_NODE
+static bool numa_node_valid(int node) {
+    return node == NUMA_NO_NODE || (node >= 0 && node < nr_node_ids && node_online(node));
+}
+
+// slot_default_node: Returns the node new slots are placed on, per the numa_node parameter
+static int slot_default_node(void) {
+    int node = READ_ONCE(numa_node);
+
+    return numa_node_valid(node) ? node : NUMA_NO_NODE;
+}
+
+// device_open: Handles opening the device file.
+// It locates or creates a slot corresponding to the minor number,
+// and allocates per-file descriptor state holding a reference on that slot.
+static int device_open(struct inode* inode, struct file* file) {
+    int minor = iminor(inode);
+    fd_state_t* state;
+    slot_t* slot;
+    char name[8];
+    int node;
+
+    if (minor < 0 || minor >= SLOT_TABLE_SIZE) {
+        return -ENODEV;
+    }
+
+    // Allocate per-file descriptor state up front so slot creation is the only step under the lock
+    state = kmem_cache_alloc(fd_state_cache, GFP_KERNEL);
+    if (!state) {
+        return -ENOMEM;
+    }
+
+    // Fast path: the slot already exists
+    rcu_read_lock();
+    slot = rcu_dereference(slot_table[minor]);
+    if (slot && !kref_get_unless_zero(&slot->refcount)) {
+        slot = NULL;
+    }
+    rcu_read_unlock();
+    if (slot) {
+        goto init_state;
+    }
+
+    // If no slot exists for this minor yet, create one and add it to the slot table
+    mutex_lock(&slot_table_lock);
+    slot = rcu_dereference_protected(slot_table[minor], lockdep_is_held(&slot_table_lock));
+    if (!slot) {
+        node = slot_default_node();
+        slot = kmem_cache_alloc_node(slot_cache, GFP_KERNEL, node);
+        if (!slot) {
+            mutex_unlock(&slot_table_lock);
+            kmem_cache_free(fd_state_cache, state);
+            printk(KERN_ERR "message_slot: Failed to allocate slot for minor %d\n", minor);
+            return -ENOMEM;
+        }
+        slot->minor = minor;
+        slot->max_message_length = max_message_length;
+        slot->dedup = false;
+        slot->node = node;
+        slot->mmap_area = NULL;
+        if (mmap_channels) {
+            slot->mmap_area = vmalloc_user(round_up(mmap_channels * sizeof(struct msg_slot_mmap_entry), PAGE_SIZE));
+            if (!slot->mmap_area) {
+                mutex_unlock(&slot_table_lock);
+                kmem_cache_free(slot_cache, slot);
+                kmem_cache_free(fd_state_cache, state);
+                printk(KERN_ERR "message_slot: Failed to allocate mmap area for minor %d\n", minor);
+                return -ENOMEM;
+            }
+        }
+        slot->stats = alloc_percpu(slot_stats_t);
+        slot->latency = alloc_percpu(slot_latency_t);
+        if (!slot->stats || !slot->latency || percpu_counter_init(&slot->memory, 0, GFP_KERNEL)) {
+            mutex_unlock(&slot_table_lock);
+            free_percpu(slot->stats);
+            free_percpu(slot->latency);
+            vfree(slot->mmap_area);
+            kmem_cache_free(slot_cache, slot);
+            kmem_cache_free(fd_state_cache, state);
+            printk(KERN_ERR "message_slot: Failed to allocate statistics for minor %d\n", minor);
+            return -ENOMEM;
+        }
+        kref_init(&slot->refcount);  // Reference owned by the slot table
+        mutex_init(&slot->lock);
+        xa_init(&slot->channels);
+        ida_init(&slot->mmap_ida);
+        spin_lock_init(&slot->lru_lock);
+        INIT_LIST_HEAD(&slot->lru);
+        snprintf(name, sizeof(name), "%d", minor);
+        slot->debugfs_dir = debugfs_create_dir(name, debugfs_root);
+        debugfs_create_file("stats", 0444, slot->debugfs_dir, slot, &slot_stats_fops);
+        debugfs_create_file("latency", 0444, slot->debugfs_dir, slot, &slot_latency_fops);
+        debugfs_create_file("snapshot", 0400, slot->debugfs_dir, slot, &slot_snapshot_fops);
+        rcu_assign_pointer(slot_table[minor], slot);
+    }
+    kref_get(&slot->refcount);
+    mutex_unlock(&slot_table_lock);
+
+init_state:
+    slot_stat_inc(slot, opens);
+
+    // Initialize per-file descriptor state
+    state->channel_id = 0;           // Default channel ID is 0 (no channel selected)
+    state->censorship_enabled = 0;   // Censorship disabled by default
+    state->slot = slot;              // Slot of this minor, resolved once for the fd's lifetime
+    spin_lock_init(&state->lock);
+    RCU_INIT_POINTER(state->channel, NULL);   // Resolved on MSG_SLOT_CHANNEL
+    state->last_seen = 0;            // Nothing read yet
+    init_waitqueue_head(&state->poll_wait);
+    init_waitqueue_func_entry(&state->read_relay, fd_relay_wake);
+    state->read_relay.private = &state->poll_wait;
+    init_waitqueue_func_entry(&state->space_relay, fd_relay_wake);
+    state->space_relay.private = &state->poll_wait;
+    state->relay_channel = NULL;     // Registered by the first poll
+    state->read_mode = MSG_SLOT_READ_SELECTED;
+    mutex_init(&state->sub_lock);
+    xa_init(&state->subscriptions);
+    state->sub_count = 0;
+    state->sub_cursor = 0;
+    state->spliced = false;
+    init_waitqueue_head(&state->sub_wait);
+    rate_limit_init(&state->rate);
+    state->fixed_size = 0;
+    fd_select_handlers(state);
+    file->private_data = state;      // Store state in file's private data
+    file->f_mode |= FMODE_NOWAIT;    // IOCB_NOWAIT transfers never sleep
+    return 0;
+}
+
+// fd_batch: Transfers every entry of a user array of batch entries through a fd, storing
+// each entry's status. Batched writes honour the fd's censorship mode; batched transfers
+// never block. With nowait set, as NONBLOCK_NOWAIT transfers, the batch stops at the first
+// write it cannot perform without sleeping, failing with -EAGAIN if that is the first entry.
+// Returns the number of entries processed.
+static long fd_batch(fd_state_t* state, struct msg_slot_batch_entry __user* uentries, __u32 count, int write,
+                     bool nowait) {
+    struct msg_slot_batch_entry entry;
+    int nonblock = nowait ? NONBLOCK_NOWAIT : 1;
+    channel_t* channel;
+    ssize_t status;
+    __u32 i;
+
+    if (count > MSG_SLOT_BATCH_MAX) {
+        return -E2BIG;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (copy_from_user(&entry, &uentries[i], sizeof(entry))) {
+            return i ? (long) i : -EFAULT;
+        }
+
+        if (entry.channel_id == 0) {
+            status = -EINVAL;
+        } else if (write) {
+            if (nowait)
+                channel = slot_find_channel(state->slot, entry.channel_id);
+            else
+                channel = slot_get_channel(state->slot, entry.channel_id);
+            if (!channel) {
+                status = nowait ? -EAGAIN : -ENOMEM;
+            } else {
+                status = writer_admit(state->slot, &state->rate, &channel->rate, 1);
+                if (status == 0) {
+                    status = channel_write(channel, (const char __user*) (uintptr_t) entry.buffer,
+                                           entry.length, state->censorship_enabled, nonblock);
+                    if (status < 0)
+                        writer_refund(&state->rate, &channel->rate);
+                }
+                channel_put(channel);
+            }
+            if (status == -EAGAIN && nowait) {
+                return i ? (long) i : -EAGAIN;
+            }
+        } else {
+            channel = slot_find_channel(state->slot, entry.channel_id);
+            if (!channel) {
+                status = -EWOULDBLOCK;
+            } else {
+                status = channel_read(channel, (char __user*) (uintptr_t) entry.buffer, entry.length, nonblock,
+                                      NULL);
+                channel_put(channel);
+            }
+        }
+
+        if (put_user((__s32) status, &uentries[i].status)) {
+            return i ? (long) i : -EFAULT;
+        }
+        if (!nowait)
+            cond_resched();
+    }
+    return count;
+}
+
+// device_batch: Handles MSG_SLOT_BATCH_WRITE and MSG_SLOT_BATCH_READ by transferring every
+// entry of the user's vector in one call, storing each entry's result in its status field.
+// Returns the number of entries processed, as fd_batch.
+static long device_batch(fd_state_t* state, struct msg_slot_batch __user* ubatch, int write) {
+    struct msg_slot_batch batch;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch))) {
+        return -EFAULT;
+    }
+    return fd_batch(state, (struct msg_slot_batch_entry __user*) (uintptr_t) batch.entries, batch.count, write,
+                    false);
+}
+
+// device_restore: Handles MSG_SLOT_RESTORE by publishing every record of a snapshot on the
+// fd's slot straight from the user's buffer. Returns the number of records restored.
+static long device_restore(fd_state_t* state, struct msg_slot_restore __user* urestore) {
+    struct msg_slot_restore restore;
+    struct msg_slot_snapshot_header header;
+    struct msg_slot_record record;
+    slot_t* slot = state->slot;
+    const char __user* buffer;
+    channel_t* channel;
+    u64 offset = sizeof(header);
+    u64 size;
+    long restored = 0;
+    ssize_t rc = 0;
+
+    if (copy_from_user(&restore, urestore, sizeof(restore))) {
+        return -EFAULT;
+    }
+    buffer = u64_to_user_ptr(restore.buffer);
+    if (restore.length < sizeof(header)) {
+        return -EINVAL;
+    }
+    if (copy_from_user(&header, buffer, sizeof(header))) {
+        return -EFAULT;
+    }
+    if (header.magic != MSG_SLOT_SNAPSHOT_MAGIC || header.version != MSG_SLOT_SNAPSHOT_VERSION ||
+        header.reserved != 0 || header.max_message_length == 0 ||
+        header.max_message_length > MSG_SLOT_MAX_LARGE_LENGTH) {
+        return -EINVAL;
+    }
+    if (header.max_message_length > READ_ONCE(slot->max_message_length))
+        WRITE_ONCE(slot->max_message_length, header.max_message_length);
+
+    while (offset < restore.length) {
+        if (restore.length - offset < sizeof(record)) {
+            rc = -EINVAL;
+            break;
+        }
+        if (copy_from_user(&record, buffer + offset, sizeof(record))) {
+            rc = -EFAULT;
+            break;
+        }
+        size = ALIGN((u64) sizeof(record) + record.length, MSG_SLOT_RECORD_ALIGN);
+        if (record.channel_id == 0 || size > restore.length - offset) {
+            rc = -EINVAL;
+            break;
+        }
+
+        channel = slot_get_channel(slot, record.channel_id);
+        if (!channel) {
+            rc = -ENOMEM;
+            break;
+        }
+        rc = channel_write(channel, buffer + offset + sizeof(record), record.length, 0, 1);
+        channel_put(channel);
+        if (rc < 0) {
+            break;
+        }
+        restored++;
+        offset += size;
+        cond_resched();
+    }
+    if (restored == 0 && rc < 0) {
+        return rc;
+    }
+    return restored;
 }
 
-// Module initialization function: registers the character device
-static int __init message_slot_init(void) {
-    int rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &fops);
-    if (rc < 0) {
-        printk(KERN_ERR "message_slot: failed to register device\n");
-        return rc;
+// Channels described per RCU read-side section of MSG_SLOT_LIST_CHANNELS
+#define LIST_CHUNK 256
+
+// channel_info: Describes a channel for MSG_SLOT_LIST_CHANNELS. Called under rcu_read_lock;
+// now_ns and now are the current CLOCK_MONOTONIC time and jiffies.
+static void channel_info(channel_t* channel, struct msg_slot_channel_info* info, u64 now_ns, unsigned long now) {
+    message_t* message;
+
+    info->channel_id = channel->id;
+    info->sequence = channel_sequence(channel);
+    message = rcu_dereference(channel->message);
+    info->message_length = message ? message->length : 0;
+    info->last_write_ns = now_ns - jiffies_to_nsecs(now - READ_ONCE(channel->last_write));
+    info->flags = 0;
+    if (rcu_access_pointer(channel->queue)) {
+        // A write racing with the switch to queue mode may still have published a message
+        info->message_length = 0;
+        info->flags = MSG_SLOT_CHANNEL_QUEUED;
     }
-    printk(KERN_INFO "message_slot: module loaded\n");
-    return 0;
+    info->reserved = 0;
 }
 
-// Module cleanup function: unregisters the character device
-static void __exit message_slot_cleanup(void) {
-    unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
-    printk(KERN_INFO "message_slot: module unloaded\n");
-}
+// device_list_channels: Handles MSG_SLOT_LIST_CHANNELS, describing up to LIST_CHUNK channels
+// per RCU read-side section and copying each chunk out once the section has ended
+static long device_list_channels(fd_state_t* state, struct msg_slot_list __user* ulist) {
+    struct msg_slot_channel_info* info;
+    struct msg_slot_channel_info __user* uentries;
+    struct msg_slot_list list;
+    slot_t* slot = state->slot;
+    channel_t* channel;
+    unsigned long id;
+    bool more = true;
+    u32 done = 0;
+    u32 n, want;
+    long rc = 0;
 
-module_init(message_slot_init);
-module_exit(message_slot_cleanup);
+    if (copy_from_user(&list, ulist, sizeof(list))) {
+        return -EFAULT;
+    }
+    if (list.count > MSG_SLOT_LIST_MAX || list.reserved != 0) {
+        return -EINVAL;
+    }
+    if (list.cursor > UINT_MAX) {
+        list.count = 0;
+        list.cursor = 0;
+        return copy_to_user(ulist, &list, sizeof(list)) ? -EFAULT : 0;
+    }
+    info = kmalloc_array(LIST_CHUNK, sizeof(*info), GFP_KERNEL);
+    if (!info) {
+        return -ENOMEM;
+    }
+    uentries = u64_to_user_ptr(list.entries);
 
-// device_open: Handles opening the device file.
-// It locates or creates a slot corresponding to the minor number,
-// and allocates per-file descriptor state.
-static int device_open(struct inode* inode, struct file* file) {
-    int minor = iminor(inode);
-    fd_state_t* state;
+    id = list.cursor;
+    while (done < list.count) {
+        u64 now_ns = ktime_get_ns();
+        unsigned long now = jiffies;
+
+        want = min_t(u32, list.count - done, LIST_CHUNK);
+        n = 0;
+        rcu_read_lock();
+        for (channel = xa_find(&slot->channels, &id, UINT_MAX, XA_PRESENT); channel;
+             channel = xa_find_after(&slot->channels, &id, UINT_MAX, XA_PRESENT)) {
+            if (n == want)
+                break;   // id is left at the first channel not described
+            channel_info(channel, &info[n++], now_ns, now);
+        }
+        rcu_read_unlock();
 
-    // Search for existing slot with matching minor number
-    slot_t* slot = slot_list_head;
-    while (slot != NULL) {
-        if (slot->minor == minor) {
+        if (copy_to_user(uentries + done, info, n * sizeof(*info))) {
+            rc = -EFAULT;
+            break;
+        }
+        done += n;
+        if (!channel) {
+            more = false;   // Listed every channel
             break;
         }
-        slot = slot->next;
+        cond_resched();
+    }
+    kfree(info);
+    if (rc) {
+        return rc;
     }
 
-    // If slot not found, create a new one and add it to the global list
-    if (!slot) {
-        slot = kmalloc(sizeof(slot_t), GFP_KERNEL);
-        if (!slot) {
-            printk(KERN_ERR "message_slot: Failed to allocate slot for minor %d\n", minor);
-            return -ENOMEM;
-        }
-        slot->minor = minor;
-        slot->channels = NULL;
-        slot->next = slot_list_head;
-        slot_list_head = slot;
+    list.count = done;
+    list.cursor = more ? id : 0;
+    if (copy_to_user(ulist, &list, sizeof(list))) {
+        return -EFAULT;
     }
+    return done;
+}
 
-    // Allocate and initialize per-file descriptor state
-    state = kmalloc(sizeof(fd_state_t), GFP_KERNEL);
-    if (!state) {
+// device_multicast: Handles MSG_SLOT_MULTICAST by copying (and censoring, per the fd's mode)
+// the message from user space once and publishing that one buffer on every listed channel,
+// each channel taking a reference. Channels are created as needed; a multicast never
+// blocks, so a channel whose MSG_SLOT_QUEUE_BLOCK queue is full is skipped.
+// Returns the number of channels written.
+static long device_multicast(fd_state_t* state, struct msg_slot_multicast __user* umulticast) {
+    struct msg_slot_multicast multicast;
+    slot_t* slot = state->slot;
+    channel_t* channel;
+    message_t* message;
+    __u32* ids;
+    long delivered = 0;
+    long rc = 0;
+    __u32 i;
+
+    if (copy_from_user(&multicast, umulticast, sizeof(multicast))) {
+        return -EFAULT;
+    }
+    if (multicast.count == 0 || multicast.count > MSG_SLOT_MULTICAST_MAX) {
+        return -EINVAL;
+    }
+    if (multicast.length == 0 || multicast.length > READ_ONCE(slot->max_message_length)) {
+        slot_stat_inc(slot, write_too_big);
+        return -EMSGSIZE;
+    }
+
+    ids = kvmalloc_array(multicast.count, sizeof(*ids), GFP_KERNEL);
+    if (!ids) {
         return -ENOMEM;
     }
-    state->channel_id = 0;           // Default channel ID is 0 (no channel selected)
-    state->censorship_enabled = 0;   // Censorship disabled by default
-    file->private_data = state;      // Store state in file's private data
-    return 0;
+    if (copy_from_user(ids, (const void __user*) (uintptr_t) multicast.channel_ids,
+                       multicast.count * sizeof(*ids))) {
+        rc = -EFAULT;
+        goto out_ids;
+    }
+    for (i = 0; i < multicast.count; i++) {
+        if (ids[i] == 0) {
+            rc = -EINVAL;
+            goto out_ids;
+        }
+    }
+    rc = writer_admit(slot, &state->rate, NULL, 1);   // A multicast is one write of the fd
+    if (rc) {
+        goto out_ids;
+    }
+
+    message = message_alloc(multicast.length, READ_ONCE(slot->node), GFP_KERNEL);
+    if (!message) {
+        rc = -ENOMEM;
+        goto out_refund;
+    }
+    refcount_set(&message->refs, 1);   // Ours, until every channel holds its own
+    if (message_copy_from_user(slot, message, (const char __user*) (uintptr_t) multicast.buffer,
+                               multicast.length, state->censorship_enabled)) {
+        message_free(message);
+        rc = -EFAULT;
+        goto out_refund;
+    }
+    if (READ_ONCE(slot->dedup))
+        message = message_dedup(slot, message);
+
+    for (i = 0; i < multicast.count; i++) {
+        channel = slot_get_channel(slot, ids[i]);
+        if (!channel) {
+            rc = -ENOMEM;
+            break;
+        }
+        if (writer_admit(slot, NULL, &channel->rate, 1)) {
+            channel_put(channel);
+            continue;
+        }
+        refcount_inc(&message->refs);
+        if (rcu_access_pointer(channel->queue)) {
+            if (channel_enqueue(channel, message, 1)) {
+                message_put(message);   // Not queued; ours keeps it alive
+                writer_refund(NULL, &channel->rate);
+                channel_put(channel);
+                continue;
+            }
+        } else {
+            channel_publish(channel, message);
+        }
+        channel_touch(channel);
+        channel_put(channel);
+        slot_stat_inc(slot, writes);
+        slot_stat_add(slot, bytes_written, multicast.length);
+        delivered++;
+        cond_resched();
+    }
+    message_put(message);
+
+out_refund:
+    if (!delivered)
+        writer_refund(&state->rate, NULL);
+out_ids:
+    kvfree(ids);
+    return delivered ? delivered : rc;
 }
 
-// device_ioctl: Handles ioctl commands to set channel or censorship mode
-static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+// do_device_ioctl: Handles ioctl commands to set channel or censorship mode, and batched transfers.
+// Selecting a channel resolves (and creates if needed) the channel once, so that
+// reads and writes on the fd do no lookup at all.
+static long do_device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
     fd_state_t* state;
+    channel_t* channel;
+    struct msg_slot_queue_config queue_config;
+    struct msg_slot_rate_limit rate_config;
+    struct msg_slot_mmap_entry* entry;
+    int node;
+    long rc;
 
     // Validate input pointer
     if (!file || !file->private_data) {
@@ -142,7 +2892,11 @@ static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsig
             if (ioctl_param == 0) {
                 return -EINVAL;
             }
-            state->channel_id = (unsigned int) ioctl_param;
+            channel = slot_get_channel(state->slot, (unsigned int) ioctl_param);
+            if (!channel) {
+                return -ENOMEM;
+            }
+            fd_set_channel(state, channel);
             return 0;
 
         case MSG_SLOT_SET_CEN:
@@ -150,135 +2904,565 @@ static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsig
                 return -EINVAL;
             }
             state->censorship_enabled = (int) ioctl_param;
+            fd_select_handlers(state);
+            return 0;
+
+        case MSG_SLOT_SET_FIXED_SIZE:
+            if (ioctl_param > UINT_MAX || fd_handlers_index((unsigned int) ioctl_param) < 0) {
+                return -EINVAL;
+            }
+            state->fixed_size = (unsigned int) ioctl_param;
+            fd_select_handlers(state);
+            return 0;
+
+        case MSG_SLOT_SET_MAX_LEN:
+            if (ioctl_param == 0 || ioctl_param > MSG_SLOT_MAX_LARGE_LENGTH) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(state->slot->max_message_length, (unsigned int) ioctl_param);
+            return 0;
+
+        case MSG_SLOT_SET_QUEUE:
+            if (copy_from_user(&queue_config, (void __user*) ioctl_param, sizeof(queue_config))) {
+                return -EFAULT;
+            }
+            channel = fd_get_channel(state);
+            if (IS_ERR(channel)) {
+                return PTR_ERR(channel);
+            }
+            rc = channel_set_queue(channel, &queue_config);
+            channel_put(channel);
+            return rc;
+
+        case MSG_SLOT_SET_CHANNEL_RATE:
+        case MSG_SLOT_SET_FD_RATE:
+            if (copy_from_user(&rate_config, (void __user*) ioctl_param, sizeof(rate_config))) {
+                return -EFAULT;
+            }
+            if (ioctl_command_id == MSG_SLOT_SET_FD_RATE) {
+                return rate_limit_set(&state->rate, &rate_config);
+            }
+            channel = fd_get_channel(state);
+            if (IS_ERR(channel)) {
+                return PTR_ERR(channel);
+            }
+            rc = rate_limit_set(&channel->rate, &rate_config);
+            channel_put(channel);
+            return rc;
+
+        case MSG_SLOT_MMAP_INDEX:
+            channel = fd_get_channel(state);
+            if (IS_ERR(channel)) {
+                return PTR_ERR(channel);
+            }
+            entry = READ_ONCE(channel->mmap_entry);
+            channel_put(channel);
+            if (!entry) {
+                return -ENOSPC;
+            }
+            return entry - state->slot->mmap_area;
+
+        case MSG_SLOT_DELETE_CHANNEL:
+            if (ioctl_param == 0) {
+                return -EINVAL;
+            }
+            channel = slot_find_channel(state->slot, (unsigned int) ioctl_param);
+            if (!channel) {
+                return -ENOENT;
+            }
+            rc = slot_delete_channel(state->slot, channel);
+            channel_put(channel);
+            if (rc == 0)
+                slot_stat_inc(state->slot, channels_deleted);
+            return rc;
+
+        case MSG_SLOT_RESTORE:
+            return device_restore(state, (struct msg_slot_restore __user*) ioctl_param);
+
+        case MSG_SLOT_LIST_CHANNELS:
+            return device_list_channels(state, (struct msg_slot_list __user*) ioctl_param);
+
+        case MSG_SLOT_SET_NODE:
+            // Checked before narrowing to int; -1 arrives sign-extended, or zero-extended
+            // from a 32-bit int argument
+            if (ioctl_param == (unsigned long) NUMA_NO_NODE || ioctl_param == (unsigned int) NUMA_NO_NODE) {
+                node = NUMA_NO_NODE;
+            } else if (ioctl_param < (unsigned long) nr_node_ids && numa_node_valid((int) ioctl_param)) {
+                node = (int) ioctl_param;
+            } else {
+                return -EINVAL;
+            }
+            WRITE_ONCE(state->slot->node, node);
+            return 0;
+
+        case MSG_SLOT_SET_DEDUP:
+            if (ioctl_param != 0 && ioctl_param != 1) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(state->slot->dedup, ioctl_param != 0);
+            return 0;
+
+        case MSG_SLOT_MULTICAST:
+            return device_multicast(state, (struct msg_slot_multicast __user*) ioctl_param);
+
+        case MSG_SLOT_SUBSCRIBE:
+            if (ioctl_param == 0) {
+                return -EINVAL;
+            }
+            return fd_subscribe(state, (unsigned int) ioctl_param);
+
+        case MSG_SLOT_UNSUBSCRIBE:
+            return fd_unsubscribe(state, (unsigned int) ioctl_param);
+
+        case MSG_SLOT_SET_READ_MODE:
+            if (ioctl_param != MSG_SLOT_READ_SELECTED && ioctl_param != MSG_SLOT_READ_SUBSCRIBED) {
+                return -EINVAL;
+            }
+            WRITE_ONCE(state->read_mode, (int) ioctl_param);
+            fd_select_handlers(state);
+            // Pollers wait on the previous mode's queue; let them report the new one
+            wake_up_interruptible(&state->poll_wait);
+            wake_up_interruptible(&state->sub_wait);
             return 0;
 
+        case MSG_SLOT_BATCH_WRITE:
+            return device_batch(state, (struct msg_slot_batch __user*) ioctl_param, 1);
+
+        case MSG_SLOT_BATCH_READ:
+            return device_batch(state, (struct msg_slot_batch __user*) ioctl_param, 0);
+
         default:
             return -EINVAL;
     }
 }
 
-// device_write: Write a message to the selected channel, applying censorship if enabled
-// Note: No need to free old message buffer, as channel->message is fixed-size and reused.
-static ssize_t device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset) {
+// device_mmap: Maps the slot's array of channel mirrors read-only into user space
+static int device_mmap(struct file* file, struct vm_area_struct* vma) {
     fd_state_t* state;
-    slot_t* slot;
-    channel_t* channel;
-    int minor;
-    char* kbuf;
 
-    // Validate input
-    if (!file || !file->private_data || !buffer) {
+    if (!file || !file->private_data) {
         return -EINVAL;
     }
     state = (fd_state_t*) file->private_data;
-    if (state->channel_id == 0) {
-        return -EINVAL;
+    if (!state->slot->mmap_area) {
+        return -ENODEV;
     }
-    if (length == 0 || length > MAX_MESSAGE_LENGTH) {
-        return -EMSGSIZE;
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
     }
+    vm_flags_clear(vma, VM_MAYWRITE);
+    return remap_vmalloc_range(vma, state->slot->mmap_area, vma->vm_pgoff);
+}
 
-    // Find slot for this minor
-    minor = iminor(file_inode(file));
-    slot = slot_list_head;
-    while (slot) {
-        if (slot->minor == minor)
-            break;
-        slot = slot->next;
-    }
-    if (!slot) {
-        // Should not happen, but for safety
-        return -EINVAL;
+// fd_write_channel: Writes a message through a fd to the given channel, or to the fd's
+// selected channel if channel_id is 0, applying censorship if enabled on the fd.
+// A NONBLOCK_NOWAIT write fails with -EAGAIN rather than create the channel.
+static ssize_t fd_write_channel(fd_state_t* state, const char __user* buffer, size_t length,
+                                unsigned int channel_id, int nonblock) {
+    channel_t* channel;
+    ssize_t rc;
+
+    if (channel_id == 0) {
+        return READ_ONCE(state->write)(state, buffer, length, nonblock);
     }
 
-    // Find or create channel for this channel_id
-    channel = slot->channels;
-    while (channel) {
-        if (channel->id == state->channel_id)
-            break;
-        channel = channel->next;
+    // A writer blocked on a channel that gets deleted retries on its replacement
+    do {
+        if (nonblock == NONBLOCK_NOWAIT) {
+            channel = slot_find_channel(state->slot, channel_id);
+            if (!channel) {
+                return -EAGAIN;
+            }
+        } else {
+            channel = slot_get_channel(state->slot, channel_id);
+            if (!channel) {
+                return -ENOMEM;
+            }
+        }
+        rc = writer_admit(state->slot, &state->rate, &channel->rate, nonblock);
+        if (rc == 0) {
+            rc = channel_write(channel, buffer, length, state->censorship_enabled, nonblock);
+            if (rc < 0)
+                writer_refund(&state->rate, &channel->rate);
+        }
+        channel_put(channel);
+    } while (rc == -EIDRM);
+    return rc;
+}
+
+// do_device_write: Write a message to the selected channel, applying censorship if enabled.
+// A non-zero file offset, as passed by pwrite(), names the target channel instead,
+// so a single syscall selects the channel and transfers the message.
+static ssize_t do_device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset) {
+    // Validate input
+    if (!file || !file->private_data || !buffer) {
+        return -EINVAL;
     }
-    if (!channel) {
-        channel = kmalloc(sizeof(channel_t), GFP_KERNEL);
-        if (!channel)
-            return -ENOMEM;
-        channel->id = state->channel_id;
-        channel->message_length = 0;
-        channel->next = slot->channels;
-        slot->channels = channel;
+    if (offset && (*offset < 0 || *offset > UINT_MAX)) {
+        return -EINVAL;
     }
+    WRITE_ONCE(((fd_state_t*) file->private_data)->spliced, false);
+    return fd_write_channel(file->private_data, buffer, length, offset ? (unsigned int) *offset : 0,
+                            (file->f_flags & O_NONBLOCK) != 0);
+}
 
-    // Allocate kernel buffer
-    kbuf = kmalloc(length, GFP_KERNEL);
-    if (!kbuf)
-        return -ENOMEM;
-    if (copy_from_user(kbuf, buffer, length)) {
-        kfree(kbuf);
-        return -EFAULT;
-    }
+// fd_read_channel: Reads a message through a fd from the given channel, or from the fd's
+// selected channel (or its subscriptions, in the MSG_SLOT_READ_SUBSCRIBED mode) if
+// channel_id is 0. Reads of an empty channel block until it is written, unless nonblock is set.
+static ssize_t fd_read_channel(fd_state_t* state, char __user* buffer, size_t length, unsigned int channel_id,
+                               int nonblock) {
+    fd_read_fn read = NULL;
+    channel_t* channel;
+    ssize_t rc;
 
-    // Apply censorship: replace every third character with '#'
-    if (state->censorship_enabled) {
-        size_t i;
-        for (i = 2; i < length; i += 3) {
-            kbuf[i] = '#';
-        }
+    if (channel_id == 0) {
+        slot_stat_inc(state->slot, lookups_cached);
+        read = READ_ONCE(state->read);
     }
 
-    // Copy message into the channel
-    memcpy(channel->message, kbuf, length);
-    channel->message_length = length;
-    kfree(kbuf);
-    return length;
+    // A reader blocked on a channel that gets deleted retries on its replacement
+    do {
+        if (channel_id == 0) {
+            rc = read(state, buffer, length, nonblock);
+            continue;
+        }
+        // A blocking read needs the channel to exist to wait on it
+        if (nonblock) {
+            channel = slot_find_channel(state->slot, channel_id);
+        } else {
+            channel = slot_get_channel(state->slot, channel_id);
+        }
+        if (!channel) {
+            return nonblock ? -EWOULDBLOCK : -ENOMEM;
+        }
+        rc = channel_read(channel, buffer, length, nonblock, NULL);
+        channel_put(channel);
+    } while (rc == -EIDRM);
+    return rc;
 }
 
-// device_read: Reads the last written message from the selected channel.
+// do_device_read: Reads the last written message from the selected channel.
+// A non-zero file offset, as passed by pread(), names the channel to read instead.
+// Reads of an empty channel block until it is written, unless the fd is O_NONBLOCK.
+// In the MSG_SLOT_READ_SUBSCRIBED mode, plain reads return the fd's subscription records.
 // Returns the number of bytes read, or an appropriate error code.
-static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset) {
-    fd_state_t* state;
-    slot_t* slot;
-    channel_t* channel;
-    int minor;
-
+static ssize_t do_device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset) {
     // Validate file and private data
     if (!file || !file->private_data || !buffer) {
         return -EINVAL;
     }
+    if (offset && (*offset < 0 || *offset > UINT_MAX)) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(((fd_state_t*) file->private_data)->spliced, false);
+    return fd_read_channel(file->private_data, buffer, length, offset ? (unsigned int) *offset : 0,
+                           (file->f_flags & O_NONBLOCK) != 0);
+}
 
-    state = (fd_state_t*) file->private_data;
-    if (state->channel_id == 0) {
+// do_device_write_iter: Writes the whole of an iov_iter as one message, to the channel named
+// by the file position or to the selected channel, as do_device_write does for a user buffer.
+// splice() into the device writes what the pipe holds, up to the requested length, as one
+// message per call.
+static ssize_t do_device_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+    struct file* file = iocb->ki_filp;
+    fd_state_t* state = file->private_data;
+    loff_t pos = iocb->ki_pos;
+    int nonblock;
+    channel_t* channel;
+    ssize_t rc;
+
+    if (!state) {
+        return -EINVAL;
+    }
+    if (pos < 0 || pos > UINT_MAX) {
         return -EINVAL;
     }
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        nonblock = NONBLOCK_NOWAIT;
+    else
+        nonblock = (file->f_flags & O_NONBLOCK) != 0;
+    if (pos == 0)
+        slot_stat_inc(state->slot, lookups_cached);
 
-    // Find the slot by minor number
-    minor = iminor(file_inode(file));
-    slot = slot_list_head;
-    while (slot) {
-        if (slot->minor == minor) break;
-        slot = slot->next;
+    do {
+        if (pos != 0 && nonblock == NONBLOCK_NOWAIT) {
+            channel = slot_find_channel(state->slot, (unsigned int) pos);
+            if (!channel) {
+                return -EAGAIN;
+            }
+        } else if (pos != 0) {
+            channel = slot_get_channel(state->slot, (unsigned int) pos);
+            if (!channel) {
+                return -ENOMEM;
+            }
+        } else {
+            channel = nonblock == NONBLOCK_NOWAIT ? fd_find_channel(state) : fd_get_channel(state);
+            if (IS_ERR(channel)) {
+                return PTR_ERR(channel);
+            }
+        }
+        rc = writer_admit(state->slot, &state->rate, &channel->rate, nonblock);
+        if (rc == 0) {
+            rc = channel_write_iter(channel, from, state->censorship_enabled, nonblock);
+            if (rc < 0)
+                writer_refund(&state->rate, &channel->rate);
+        }
+        if (rc > 0) {
+            slot_stat_inc(channel->slot, writes);
+            slot_stat_add(channel->slot, bytes_written, rc);
+        } else if (rc == -EMSGSIZE) {
+            slot_stat_inc(channel->slot, write_too_big);
+        }
+        channel_put(channel);
+    } while (rc == -EIDRM);
+    return rc;
+}
+
+// do_device_read_iter: Reads a message into an iov_iter, from the channel named by the file
+// position or from the selected channel, as do_device_read does for a user buffer. The
+// iov_iter must have room for the whole message. splice() and sendfile() from the device
+// land here through device_splice_read, so a channel forwards to a pipe or socket without a
+// round trip through user space. Subscription records are only returned by read().
+static ssize_t do_device_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+    struct file* file = iocb->ki_filp;
+    fd_state_t* state = file->private_data;
+    loff_t pos = iocb->ki_pos;
+    int nonblock;
+    channel_t* channel;
+    ssize_t rc;
+
+    if (!state) {
+        return -EINVAL;
     }
-    if (!slot) {
+    if (pos < 0 || pos > UINT_MAX) {
+        return -EINVAL;
+    }
+    if (pos == 0 && READ_ONCE(state->read_mode) == MSG_SLOT_READ_SUBSCRIBED) {
+        return -EINVAL;
+    }
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        nonblock = NONBLOCK_NOWAIT;
+    else
+        nonblock = (file->f_flags & O_NONBLOCK) != 0;
+    if (pos == 0)
+        slot_stat_inc(state->slot, lookups_cached);
+
+    do {
+        if (pos != 0) {
+            channel = nonblock ? slot_find_channel(state->slot, (unsigned int) pos)
+                               : slot_get_channel(state->slot, (unsigned int) pos);
+            if (!channel) {
+                return nonblock ? -EWOULDBLOCK : -ENOMEM;
+            }
+        } else {
+            channel = nonblock == NONBLOCK_NOWAIT ? fd_find_channel(state) : fd_get_channel(state);
+            if (IS_ERR(channel)) {
+                return PTR_ERR(channel);
+            }
+        }
+        rc = channel_read_iter(channel, to, nonblock, pos ? NULL : &state->last_seen);
+        slot_account_read(channel->slot, rc);
+        channel_put(channel);
+    } while (rc == -EIDRM);
+    return rc;
+}
+
+// device_splice_read: Splices one message into a pipe through do_device_read_iter.
+// sendfile() and copy_file_range() splice into the task's internal pipe in a loop until
+// the requested count has been sent, and since reads neither consume a message nor move
+// the file position, the loop would otherwise send the same message over and over (and
+// drain a whole queue in queue mode). The fd records that such a splice delivered its
+// message, and the next one ends the transfer and clears the record, so every transfer
+// carries exactly one message. A read() or write() on the fd also clears it, in case a
+// transfer failed before its next splice. splice() into a user pipe reads once per call.
+static ssize_t device_splice_read(struct file* in, loff_t* ppos, struct pipe_inode_info* pipe, size_t len,
+                                  unsigned int flags) {
+    fd_state_t* state = in->private_data;
+    bool transfer = pipe == current->splice_pipe;
+    ssize_t rc;
+
+    if (!state) {
         return -EINVAL;
     }
+    if (transfer && xchg(&state->spliced, false)) {
+        return 0;
+    }
+    rc = copy_splice_read(in, ppos, pipe, len, flags);
+    if (transfer && rc > 0)
+        WRITE_ONCE(state->spliced, true);
+    return rc;
+}
+
+// device_poll: Reports the fd readable once its selected channel has a message newer
+// than the last one read through the fd, or in queue mode while the queue is not empty.
+// Writes only block on a full queue with the MSG_SLOT_QUEUE_BLOCK policy.
+// Without a selected channel the fd is neither readable nor writable until one is selected.
+// In the MSG_SLOT_READ_SUBSCRIBED mode the fd is readable once a subscribed channel has news.
+static __poll_t device_poll(struct file* file, poll_table* wait) {
+    fd_state_t* state;
+    channel_t* channel;
+    queue_t* queue;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
 
-    // Find the channel by ID
-    channel = slot->channels;
-    while (channel) {
-        if (channel->id == state->channel_id) break;
-        channel = channel->next;
+    if (!file || !file->private_data) {
+        return EPOLLERR;
+    }
+    state = (fd_state_t*) file->private_data;
+    if (READ_ONCE(state->read_mode) == MSG_SLOT_READ_SUBSCRIBED) {
+        poll_wait(file, &state->sub_wait, wait);
+        if (fd_subscriptions_pending(state))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        return mask;
     }
-    if (!channel || channel->message_length == 0) {
-        return -EWOULDBLOCK;
+    // Pollers wait on the fd's own queue, which every change of the selected channel
+    // wakes, and the relays feed from whichever channel is selected
+    poll_wait(file, &state->poll_wait, wait);
+    channel = fd_get_channel(state);
+    if (IS_ERR(channel)) {
+        return PTR_ERR(channel) == -EINVAL ? 0 : EPOLLERR;
     }
 
-    if (length < channel->message_length) {
-        return -ENOSPC;
+    fd_attach_relays(state, channel);
+    rcu_read_lock();
+    queue = rcu_dereference(channel->queue);
+    if (queue) {
+        if (!queue_empty(queue))
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (queue->policy == MSG_SLOT_QUEUE_BLOCK && queue_full(queue))
+            mask &= ~(EPOLLOUT | EPOLLWRNORM);
+    } else if (READ_ONCE(channel->sequence) != state->last_seen) {
+        mask |= EPOLLIN | EPOLLRDNORM;
     }
+    rcu_read_unlock();
+    channel_put(channel);
+    return mask;
+}
 
-    // Copy the message to user space
-    if (copy_to_user(buffer, channel->message, channel->message_length)) {
-        return -EFAULT;
+// trace_ids: Returns the minor and channel id of a call for its tracepoints: the channel
+// named by a non-zero pread/pwrite offset, or the fd's selected channel otherwise
+static void trace_ids(struct file* file, loff_t* offset, int* minor, unsigned int* channel_id) {
+    fd_state_t* state = file ? file->private_data : NULL;
+
+    *minor = state ? state->slot->minor : -1;
+    if (offset && *offset > 0 && *offset <= UINT_MAX)
+        *channel_id = (unsigned int) *offset;
+    else
+        *channel_id = state ? state->channel_id : 0;
+}
+
+// device_ioctl: Traces and dispatches an ioctl command
+static long device_ioctl(struct file* file, unsigned int ioctl_command_id, unsigned long ioctl_param) {
+    unsigned int channel_id;
+    int minor;
+    long rc;
+
+    trace_ids(file, NULL, &minor, &channel_id);
+    trace_message_slot_ioctl_enter(minor, channel_id, ioctl_command_id, ioctl_param);
+    rc = do_device_ioctl(file, ioctl_command_id, ioctl_param);
+    trace_ids(file, NULL, &minor, &channel_id);
+    trace_message_slot_ioctl_exit(minor, channel_id, ioctl_command_id, rc);
+    return rc;
+}
+
+// device_write: Traces and performs a write
+static ssize_t device_write(struct file* file, const char __user* buffer, size_t length, loff_t* offset) {
+    unsigned int channel_id;
+    int minor;
+    ssize_t rc;
+
+    trace_ids(file, offset, &minor, &channel_id);
+    trace_message_slot_write_enter(minor, channel_id, length);
+    rc = do_device_write(file, buffer, length, offset);
+    trace_message_slot_write_exit(minor, channel_id, length, rc);
+    return rc;
+}
+
+// device_read: Traces and performs a read
+static ssize_t device_read(struct file* file, char __user* buffer, size_t length, loff_t* offset) {
+    unsigned int channel_id;
+    int minor;
+    ssize_t rc;
+
+    trace_ids(file, offset, &minor, &channel_id);
+    trace_message_slot_read_enter(minor, channel_id, length);
+    rc = do_device_read(file, buffer, length, offset);
+    trace_message_slot_read_exit(minor, channel_id, length, rc);
+    return rc;
+}
+
+// device_write_iter: Traces and performs a writev() or splice() into the device
+static ssize_t device_write_iter(struct kiocb* iocb, struct iov_iter* from) {
+    size_t length = iov_iter_count(from);
+    unsigned int channel_id;
+    int minor;
+    ssize_t rc;
+
+    trace_ids(iocb->ki_filp, &iocb->ki_pos, &minor, &channel_id);
+    trace_message_slot_write_enter(minor, channel_id, length);
+    rc = do_device_write_iter(iocb, from);
+    trace_message_slot_write_exit(minor, channel_id, length, rc);
+    return rc;
+}
+
+// device_read_iter: Traces and performs a readv() or splice() from the device
+static ssize_t device_read_iter(struct kiocb* iocb, struct iov_iter* to) {
+    size_t length = iov_iter_count(to);
+    unsigned int channel_id;
+    int minor;
+    ssize_t rc;
+
+    trace_ids(iocb->ki_filp, &iocb->ki_pos, &minor, &channel_id);
+    trace_message_slot_read_enter(minor, channel_id, length);
+    rc = do_device_read_iter(iocb, to);
+    trace_message_slot_read_exit(minor, channel_id, length, rc);
+    return rc;
+}
+
+// device_uring_cmd: Handles the MSG_SLOT_URING_* commands. Issued inline with
+// IO_URING_F_NONBLOCK set, a command is a NONBLOCK_NOWAIT transfer: it is served there on
+// existing channels, and returns -EAGAIN only where it would have to sleep (to wait for a
+// message or queue space, create a channel or allocate), so that io_uring reissues it from
+// a worker thread, where it behaves like read()/write() on a fd with the same O_NONBLOCK flag.
+// The command area lives in the submission ring, so each field is read exactly once.
+static int device_uring_cmd(struct io_uring_cmd* ioucmd, unsigned int issue_flags) {
+    const struct msg_slot_uring_cmd* cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    fd_state_t* state = ioucmd->file->private_data;
+    void __user* buffer = u64_to_user_ptr(READ_ONCE(cmd->buffer));
+    __u32 length = READ_ONCE(cmd->length);
+    __u32 channel_id = READ_ONCE(cmd->channel_id);
+    int nonblock = (ioucmd->file->f_flags & O_NONBLOCK) != 0;
+    unsigned int traced_id;
+    ssize_t rc;
+
+    if (!state) {
+        return -EINVAL;
     }
+    traced_id = channel_id ? channel_id : state->channel_id;
+    if (issue_flags & IO_URING_F_NONBLOCK)
+        nonblock = NONBLOCK_NOWAIT;
+
+    switch (ioucmd->cmd_op) {
+        case MSG_SLOT_URING_READ:
+            trace_message_slot_read_enter(state->slot->minor, traced_id, length);
+            rc = fd_read_channel(state, buffer, length, channel_id, nonblock);
+            trace_message_slot_read_exit(state->slot->minor, traced_id, length, rc);
+            return rc;
 
-    return channel->message_length;
-}
\ No newline at end of file
+        case MSG_SLOT_URING_WRITE:
+            trace_message_slot_write_enter(state->slot->minor, traced_id, length);
+            rc = fd_write_channel(state, buffer, length, channel_id, nonblock);
+            trace_message_slot_write_exit(state->slot->minor, traced_id, length, rc);
+            return rc;
+
+        case MSG_SLOT_URING_BATCH_READ:
+        case MSG_SLOT_URING_BATCH_WRITE:
+            if (channel_id != 0) {
+                return -EINVAL;
+            }
+            return fd_batch(state, buffer, length, ioucmd->cmd_op == MSG_SLOT_URING_BATCH_WRITE,
+                            nonblock == NONBLOCK_NOWAIT);
+
+        default:
+            return -EINVAL;
+    }
+}
@@ -2,12 +2,267 @@
 //#define MESSAGE_SLOT_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define MAJOR_NUM 235
 #define DEVICE_RANGE_NAME "message_slot"
 #define MAX_MESSAGE_LENGTH 128
+// Upper bound for the per-slot maximum message size set with MSG_SLOT_SET_MAX_LEN
+#define MSG_SLOT_MAX_LARGE_LENGTH (1 << 20)
 
 #define MSG_SLOT_CHANNEL   _IOW(MAJOR_NUM, 0, unsigned int)
 #define MSG_SLOT_SET_CEN   _IOW(MAJOR_NUM, 1, unsigned int)
 
+// read() of an empty channel blocks until the channel is written, unless the fd is
+// O_NONBLOCK, in which case it fails with EWOULDBLOCK. poll/epoll report a fd readable
+// once its selected channel has a message newer than the last one read through that fd.
+// Readiness follows MSG_SLOT_CHANNEL: an fd registered with epoll before a channel is
+// selected, or before another one is, reports the newly selected channel.
+
+// pread()/pwrite() select the channel through the file offset: a non-zero offset is
+// the channel id to transfer on, while offset 0 (plain read()/write()) uses the
+// channel selected with MSG_SLOT_CHANNEL. The file offset itself never moves.
+
+// readv()/writev() (and preadv()/pwritev()) transfer one message scattered over or
+// gathered from the whole vector. splice() and sendfile() move a message between a
+// channel and a pipe or socket without a user-space buffer: splicing from the device
+// reads one message (the pipe must have room for it; sendfile() returns after that one
+// message whatever the requested count), splicing into it writes the pipe's contents,
+// up to the requested length, as one message. The splice offset, like the pread()
+// offset, names the channel.
+
+// Batched transfers: one ioctl writes or reads every entry of a vector.
+// Each entry's status receives the byte count or a negative errno, exactly as
+// write()/read() on a fd with that channel selected would have returned.
+// The ioctl returns the number of entries processed.
+#define MSG_SLOT_BATCH_MAX 1024
+
+struct msg_slot_batch_entry {
+    __u32 channel_id;
+    __u32 length;       // Message length for writes, buffer size for reads
+    __u64 buffer;       // User buffer holding (or receiving) the message
+    __s32 status;       // Out: bytes transferred or negative errno
+    __u32 reserved;
+};
+
+struct msg_slot_batch {
+    __u64 entries;      // Pointer to an array of struct msg_slot_batch_entry
+    __u32 count;        // Number of entries, at most MSG_SLOT_BATCH_MAX
+    __u32 reserved;
+};
+
+#define MSG_SLOT_BATCH_WRITE _IOW(MAJOR_NUM, 2, struct msg_slot_batch)
+#define MSG_SLOT_BATCH_READ  _IOW(MAJOR_NUM, 3, struct msg_slot_batch)
+
+// Zero-copy reads: mmap() of the device (read-only, MAP_SHARED) maps an array of
+// struct msg_slot_mmap_entry holding the latest message of the slot's channels.
+// MSG_SLOT_MMAP_INDEX returns the array index of the fd's selected channel, or fails
+// with ENOSPC if the channel was created while the slot's mmap area was full. The entry
+// of a deleted channel is cleared (channel_id and length 0) and may be reused.
+// An entry is consistent when its sequence was even and unchanged across the copy:
+//     do {
+//         seq = load_acquire(&entry->sequence);
+//         copy entry->channel_id, entry->length and entry->message;
+//         read barrier;
+//     } while ((seq & 1) || seq != entry->sequence);
+#define MSG_SLOT_MMAP_ENTRY_SIZE 256
+
+struct msg_slot_mmap_entry {
+    __u32 sequence;     // Odd while a write is in progress, advanced by 2 per write
+    __u32 channel_id;
+    __u32 length;       // 0 until the channel is first written
+    __u32 reserved;
+    char message[MAX_MESSAGE_LENGTH];
+    char padding[MSG_SLOT_MMAP_ENTRY_SIZE - 16 - MAX_MESSAGE_LENGTH];
+};
+
+#define MSG_SLOT_MMAP_INDEX  _IO(MAJOR_NUM, 4)
+
+// Sets the maximum message size of the fd's slot, for every fd of that slot.
+// Messages of up to MAX_MESSAGE_LENGTH bytes are stored inline; larger ones (up to
+// MSG_SLOT_MAX_LARGE_LENGTH) in page-backed buffers. The mmap entry of a channel only
+// mirrors the first MAX_MESSAGE_LENGTH bytes; its length field holds the full length.
+// Messages queued before the maximum was lowered stay queued; reading one fails with
+// ENOSPC, without consuming it, unless the buffer can hold it.
+#define MSG_SLOT_SET_MAX_LEN _IOW(MAJOR_NUM, 5, unsigned int)
+
+// Queue mode: switches the fd's selected channel from keeping only its last message to a
+// bounded FIFO of messages. Writes append, reads consume in order (with a buffer at least
+// as large as the slot's maximum message size) and block while the queue is empty unless
+// O_NONBLOCK. On overflow the oldest message is dropped, or with MSG_SLOT_QUEUE_BLOCK the
+// writer waits for room (EAGAIN if O_NONBLOCK). A capacity of 0 returns the channel to
+// overwrite mode. Messages still queued when the mode changes are dropped, as is the
+// channel's last message when it enters queue mode.
+#define MSG_SLOT_QUEUE_MAX_CAPACITY 4096
+#define MSG_SLOT_QUEUE_DROP_OLDEST  0
+#define MSG_SLOT_QUEUE_BLOCK        1
+
+struct msg_slot_queue_config {
+    __u32 capacity;     // Power of two up to MSG_SLOT_QUEUE_MAX_CAPACITY, or 0
+    __u32 policy;       // MSG_SLOT_QUEUE_DROP_OLDEST or MSG_SLOT_QUEUE_BLOCK
+};
+
+#define MSG_SLOT_SET_QUEUE _IOW(MAJOR_NUM, 6, struct msg_slot_queue_config)
+
+// Deletes the channel with the id given as the parameter from the fd's slot, discarding
+// its message (or queue) and freeing it once no fd uses it any more. Fds that selected
+// the channel keep their selection: their next transfer gets a new, empty channel of
+// the same id, and blocked readers and writers move over to it. ENOENT if no such channel.
+// Channels not written for the channel_ttl_secs module parameter, or least recently
+// written while a slot exceeds its slot_memory_cap_kb, are deleted the same way.
+#define MSG_SLOT_DELETE_CHANNEL _IOW(MAJOR_NUM, 7, unsigned int)
+
+// Subscriptions: an fd can subscribe to up to MSG_SLOT_MAX_SUBSCRIPTIONS channels of its
+// slot, independently of the channel selected with MSG_SLOT_CHANNEL. In the
+// MSG_SLOT_READ_SUBSCRIBED read mode, read() returns every subscribed channel written
+// since the fd last returned it (a channel's current message counts as new right after
+// subscribing), as a stream of records: a struct msg_slot_record followed by length bytes
+// of message, padded with zeros to a multiple of MSG_SLOT_RECORD_ALIGN. As many records as
+// fit are returned, and the next read resumes after the last channel returned; ENOSPC if
+// not even the first fits. Such reads block until a subscribed channel is written unless
+// O_NONBLOCK, and poll reports the fd readable meanwhile. Channels in queue mode are not
+// reported; they are consumed with regular reads.
+#define MSG_SLOT_MAX_SUBSCRIPTIONS 4096
+#define MSG_SLOT_RECORD_ALIGN      8
+
+#define MSG_SLOT_READ_SELECTED   0   // Default: read() returns the selected channel's message
+#define MSG_SLOT_READ_SUBSCRIBED 1
+
+struct msg_slot_record {
+    __u32 channel_id;
+    __u32 length;       // Message length, excluding the header and the padding
+};
+
+#define MSG_SLOT_SUBSCRIBE     _IOW(MAJOR_NUM, 8, unsigned int)    // EEXIST if already subscribed
+#define MSG_SLOT_UNSUBSCRIBE   _IOW(MAJOR_NUM, 9, unsigned int)    // ENOENT if not subscribed
+#define MSG_SLOT_SET_READ_MODE _IOW(MAJOR_NUM, 10, unsigned int)
+
+// Multicast: writes one message to every channel in a list of up to MSG_SLOT_MULTICAST_MAX
+// ids, creating channels as needed. The message is copied from user space (and censored,
+// per the fd's mode) once and all the channels share that copy. Never blocks: a channel
+// in queue mode whose MSG_SLOT_QUEUE_BLOCK queue is full is skipped. Returns the number
+// of channels written.
+#define MSG_SLOT_MULTICAST_MAX 1024
+
+struct msg_slot_multicast {
+    __u64 buffer;       // The message
+    __u32 length;
+    __u32 count;        // Number of channel ids
+    __u64 channel_ids;  // Pointer to an array of __u32 channel ids
+};
+
+#define MSG_SLOT_MULTICAST _IOW(MAJOR_NUM, 11, struct msg_slot_multicast)
+
+// Enables (1) or disables (0) payload deduplication for the fd's slot: a message written
+// to any channel of the slot that is identical to one currently published in the slot
+// shares that message's buffer instead of keeping its own copy. Costs a hash of every
+// written message; worthwhile for slots that mirror the same payloads on many channels.
+#define MSG_SLOT_SET_DEDUP _IOW(MAJOR_NUM, 12, unsigned int)
+
+// io_uring commands (IORING_OP_URING_CMD with the command in sqe->cmd_op): one SQE names
+// its channel and transfers a message, or a whole batch, with no MSG_SLOT_CHANNEL ioctl
+// beforehand. The payload below goes in the SQE's command area (sqe->cmd). The CQE result
+// is what read()/write() or the batch ioctls would have returned. Plain IORING_OP_READ and
+// IORING_OP_WRITE (also with registered buffers) work too, naming the channel in sqe->off.
+// Commands on existing channels complete inline; a batch write issued inline stops at the
+// first entry needing a new channel or a wait, so its CQE may report fewer entries.
+struct msg_slot_uring_cmd {
+    __u64 buffer;       // Message buffer, or array of struct msg_slot_batch_entry for batches
+    __u32 length;       // Buffer length, or number of entries for batches
+    __u32 channel_id;   // Channel to transfer on, 0 for the selected one; must be 0 for batches
+};
+
+#define MSG_SLOT_URING_READ        _IOR(MAJOR_NUM, 32, struct msg_slot_uring_cmd)
+#define MSG_SLOT_URING_WRITE       _IOW(MAJOR_NUM, 33, struct msg_slot_uring_cmd)
+#define MSG_SLOT_URING_BATCH_READ  _IOR(MAJOR_NUM, 34, struct msg_slot_uring_cmd)
+#define MSG_SLOT_URING_BATCH_WRITE _IOW(MAJOR_NUM, 35, struct msg_slot_uring_cmd)
+
+// Snapshots: /sys/kernel/debug/message_slot/<minor>/snapshot streams the contents of a
+// slot as a struct msg_slot_snapshot_header followed by one struct msg_slot_record per
+// non-empty channel, in channel id order, each followed by the channel's last message
+// and padded to MSG_SLOT_RECORD_ALIGN bytes, as for MSG_SLOT_READ_SUBSCRIBED reads.
+// Queued messages (MSG_SLOT_SET_QUEUE) are not part of a snapshot.
+// MSG_SLOT_RESTORE publishes every record of such a snapshot on the fd's slot in one
+// call, e.g. to warm the slots up again after a module reload. Channels are created as
+// needed and written without censorship; the slot's maximum message length is raised to
+// the snapshot's if lower. Returns the number of records restored, stopping at the first
+// failing one (failing with its error if it is the first).
+#define MSG_SLOT_SNAPSHOT_MAGIC   0x4d534c53   // "MSLS"
+#define MSG_SLOT_SNAPSHOT_VERSION 1
+
+struct msg_slot_snapshot_header {
+    __u32 magic;
+    __u32 version;
+    __u32 max_message_length;   // Of the slot when the snapshot was taken
+    __u32 reserved;             // Must be 0
+};
+
+struct msg_slot_restore {
+    __u64 buffer;       // Pointer to the snapshot
+    __u64 length;       // Snapshot length in bytes
+};
+
+#define MSG_SLOT_RESTORE _IOW(MAJOR_NUM, 13, struct msg_slot_restore)
+
+// Sets the NUMA node the fd's slot allocates new channels, queues and messages on, so that
+// readers pinned to that node read node-local memory; -1 (the default, unless the
+// numa_node module parameter says otherwise) allocates on the writer's node. Existing
+// storage stays where it is until replaced by writes. Fails with EINVAL for an offline node.
+#define MSG_SLOT_SET_NODE _IOW(MAJOR_NUM, 14, int)
+
+// Channel enumeration: MSG_SLOT_LIST_CHANNELS fills entries with the channels of the fd's
+// slot in channel id order, starting at the id in cursor, and returns the number filled.
+// On return, count holds that number too and cursor the id to pass to continue, or 0 once
+// every channel was listed. Channels are read under RCU in small chunks, so listing never
+// holds up writers; a listing concurrent with writes is not an atomic snapshot.
+#define MSG_SLOT_LIST_MAX 65536
+#define MSG_SLOT_CHANNEL_QUEUED 1   // Channel is in queue mode; message_length is then 0
+
+struct msg_slot_channel_info {
+    __u32 channel_id;
+    __u32 message_length;   // Length of the last message, 0 if empty or in queue mode
+    __u64 sequence;         // Number of messages published on the channel
+    __u64 last_write_ns;    // CLOCK_MONOTONIC time of the last write (or of the channel's
+                            // creation), to within a second
+    __u32 flags;            // MSG_SLOT_CHANNEL_* flags
+    __u32 reserved;
+};
+
+struct msg_slot_list {
+    __u64 entries;      // Pointer to an array of struct msg_slot_channel_info
+    __u32 count;        // In: capacity of entries, up to MSG_SLOT_LIST_MAX; out: entries filled
+    __u32 reserved;     // Must be 0
+    __u64 cursor;       // In: lowest channel id to list; out: next id, or 0 when done
+};
+
+#define MSG_SLOT_LIST_CHANNELS _IOWR(MAJOR_NUM, 15, struct msg_slot_list)
+
+// Rate limits: token buckets refilled at rate writes per second and holding up to burst
+// tokens (burst 0 counts as 1), set on the fd's selected channel (limiting every writer of
+// the channel) or on the fd itself (limiting every write through it, on any channel).
+// A write needs a token from both. Without one it fails with EAGAIN, or, if the limit
+// responsible has MSG_SLOT_RATE_BLOCK and the fd is not O_NONBLOCK, waits for one.
+// A write that fails for any other reason gives its tokens back.
+// Batched writes and multicasts never wait: a throttled entry gets EAGAIN and a throttled
+// channel is skipped by a multicast. Rate 0 removes the limit. Throttled writes are
+// counted in the slot's debugfs stats.
+#define MSG_SLOT_RATE_BLOCK 1
+#define MSG_SLOT_RATE_MAX_BURST (1 << 20)
+
+struct msg_slot_rate_limit {
+    __u32 rate;         // Writes per second, up to 1000000000; 0 for no limit
+    __u32 burst;        // Bucket size in writes, up to MSG_SLOT_RATE_MAX_BURST
+    __u32 flags;        // MSG_SLOT_RATE_* flags
+    __u32 reserved;     // Must be 0
+};
+
+#define MSG_SLOT_SET_CHANNEL_RATE _IOW(MAJOR_NUM, 16, struct msg_slot_rate_limit)
+#define MSG_SLOT_SET_FD_RATE      _IOW(MAJOR_NUM, 17, struct msg_slot_rate_limit)
+
+// Declares that the messages written and read through the fd on its selected channel are
+// of exactly the given size, one of 8, 16, 64 or 128 (0, the default, for any size). The fd
+// then uses read and write paths compiled for that size. Transfers of other sizes still
+// work, at the generic paths' speed.
+#define MSG_SLOT_SET_FIXED_SIZE _IOW(MAJOR_NUM, 18, unsigned int)
+
 //#endif
\ No newline at end of file
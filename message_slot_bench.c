@@ -0,0 +1,526 @@
+// message_slot_bench: Multi-threaded throughput and latency benchmark of the message_slot device.
+// Writer and reader threads, optionally pinned to consecutive cores, transfer messages on a
+// configurable number of channels for a fixed duration; the program then reports the
+// operations per second and the p50/p99/p999 latencies of writes and reads. With -S the run
+// is repeated for 1, 2, 4, ... threads per role, printing a scaling curve. -m selects a mode
+// running a series of such runs that measures one property of the device (see usage).
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "message_slot.h"
+
+// Latency samples kept per thread; further operations are counted but not sampled
+#define MAX_SAMPLES (1 << 20)
+
+typedef struct {
+    const char* device;
+    int writers;
+    int readers;
+    unsigned int channels;
+    size_t size;
+    int censorship;
+    int reuse_fd;           // Keep one fd per thread instead of open/ioctl/close per message
+    int pin;
+    int seconds;
+    int scaling;
+    int node;               // NUMA node of the slot's storage, set with MSG_SLOT_SET_NODE if not -2
+    int fixed;              // Declare the message size with MSG_SLOT_SET_FIXED_SIZE on every fd
+    const char* mode;       // Name of the bench_mode_t to run
+    int serialize;          // Hold serialize_lock around every transfer, as a global lock would
+    int stick;              // Keep each thread on its first channel instead of cycling
+} bench_config_t;
+
+typedef struct {
+    pthread_t thread;
+    const bench_config_t* config;
+    int index;              // Thread number, also its core when pinning
+    int writer;
+    unsigned long ops;
+    unsigned long empty;    // Reads that found the channel empty
+    unsigned long errors;
+    unsigned long* samples; // Latency of each sampled operation, in ns
+    unsigned long nsamples;
+} bench_thread_t;
+
+static atomic_int running;
+static pthread_barrier_t start_barrier;
+static pthread_mutex_t serialize_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// open_channel: Opens the device with censorship and a selected channel, as the one-shot tools do
+static int open_channel(const bench_config_t* config, unsigned int channel_id, int flags) {
+    int fd = open(config->device, flags);
+
+    if (fd < 0)
+        return -1;
+    if (ioctl(fd, MSG_SLOT_SET_CEN, config->censorship) < 0 || ioctl(fd, MSG_SLOT_CHANNEL, channel_id) < 0 ||
+        (config->fixed && ioctl(fd, MSG_SLOT_SET_FIXED_SIZE, (unsigned int) config->size) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// transfer: Performs one write or read on a channel. With a reused fd the channel is named
+// through the pread/pwrite offset, so that no ioctl is needed per message. With -F every
+// channel has its own fd, selected once, since only plain read/write reach the specialized
+// handlers of the selected channel.
+static ssize_t transfer(bench_thread_t* t, int fd, unsigned int channel_id, char* buffer, size_t length) {
+    const bench_config_t* config = t->config;
+    ssize_t rc;
+    int own_fd = -1;
+
+    if (!config->reuse_fd) {
+        own_fd = open_channel(config, channel_id, (t->writer ? O_WRONLY : O_RDONLY) | O_NONBLOCK);
+        if (own_fd < 0)
+            return -1;
+        rc = t->writer ? write(own_fd, buffer, length) : read(own_fd, buffer, length);
+        close(own_fd);
+        return rc;
+    }
+    if (config->channels == 1 || config->fixed)
+        return t->writer ? write(fd, buffer, length) : read(fd, buffer, length);
+    return t->writer ? pwrite(fd, buffer, length, channel_id) : pread(fd, buffer, length, channel_id);
+}
+
+static void* bench_thread(void* arg) {
+    bench_thread_t* t = arg;
+    const bench_config_t* config = t->config;
+    size_t length = t->writer ? config->size : MSG_SLOT_MAX_LARGE_LENGTH;
+    char* buffer = malloc(length);
+    unsigned int channel = t->index % config->channels;
+    unsigned int nfds = 0;
+    unsigned int i;
+    unsigned long start;
+    cpu_set_t cpus;
+    ssize_t rc;
+    int* fds = NULL;
+
+    if (!buffer) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buffer, 'a' + t->index % 26, length);
+    if (config->pin) {
+        CPU_ZERO(&cpus);
+        CPU_SET(t->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    if (config->reuse_fd) {
+        nfds = config->fixed ? config->channels : 1;
+        fds = malloc(nfds * sizeof(*fds));
+        if (!fds) {
+            perror("malloc");
+            exit(1);
+        }
+        for (i = 0; i < nfds; i++) {
+            fds[i] = open_channel(config, i + 1, (t->writer ? O_WRONLY : O_RDONLY) | O_NONBLOCK);
+            if (fds[i] < 0) {
+                perror("open");
+                exit(1);
+            }
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        start = now_ns();
+        if (config->serialize)
+            pthread_mutex_lock(&serialize_lock);
+        rc = transfer(t, fds ? fds[nfds > 1 ? channel : 0] : -1, channel + 1, buffer, length);
+        if (config->serialize)
+            pthread_mutex_unlock(&serialize_lock);
+        if (t->nsamples < MAX_SAMPLES)
+            t->samples[t->nsamples++] = now_ns() - start;
+        if (rc >= 0)
+            t->ops++;
+        else if (errno == EWOULDBLOCK)
+            t->empty++;
+        else
+            t->errors++;
+        if (!config->stick && ++channel == config->channels)
+            channel = 0;
+    }
+
+    for (i = 0; i < nfds; i++)
+        close(fds[i]);
+    free(fds);
+    free(buffer);
+    return NULL;
+}
+
+static int compare_samples(const void* a, const void* b) {
+    unsigned long x = *(const unsigned long*) a;
+    unsigned long y = *(const unsigned long*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// report: Prints the throughput and latency percentiles of one role
+static void report(const char* role, bench_thread_t* threads, int count, int writer, double seconds) {
+    unsigned long ops = 0, empty = 0, errors = 0, nsamples = 0;
+    unsigned long* samples;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (threads[i].writer != writer)
+            continue;
+        ops += threads[i].ops;
+        empty += threads[i].empty;
+        errors += threads[i].errors;
+        nsamples += threads[i].nsamples;
+    }
+    if (nsamples == 0) {
+        return;
+    }
+    samples = malloc(nsamples * sizeof(*samples));
+    if (!samples) {
+        perror("malloc");
+        exit(1);
+    }
+    nsamples = 0;
+    for (i = 0; i < count; i++) {
+        if (threads[i].writer == writer) {
+            memcpy(samples + nsamples, threads[i].samples, threads[i].nsamples * sizeof(*samples));
+            nsamples += threads[i].nsamples;
+        }
+    }
+    qsort(samples, nsamples, sizeof(*samples), compare_samples);
+
+    printf("  %-6s %12.0f ops/s  p50 %8lu ns  p99 %8lu ns  p999 %8lu ns  empty %lu  errors %lu\n", role,
+           ops / seconds, samples[nsamples / 2], samples[nsamples * 99 / 100], samples[nsamples * 999 / 1000],
+           empty, errors);
+    free(samples);
+}
+
+// run: Runs one benchmark with the given numbers of writer and reader threads
+static void run(const bench_config_t* config, int writers, int readers) {
+    int count = writers + readers;
+    bench_thread_t* threads = calloc(count, sizeof(*threads));
+    unsigned long start;
+    double seconds;
+    int i;
+
+    if (!threads) {
+        perror("calloc");
+        exit(1);
+    }
+    pthread_barrier_init(&start_barrier, NULL, count + 1);
+    atomic_store(&running, 1);
+    for (i = 0; i < count; i++) {
+        threads[i].config = config;
+        threads[i].index = i;
+        threads[i].writer = i < writers;
+        threads[i].samples = malloc(MAX_SAMPLES * sizeof(unsigned long));
+        if (!threads[i].samples) {
+            perror("malloc");
+            exit(1);
+        }
+        if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i])) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    sleep(config->seconds);
+    atomic_store(&running, 0);
+    for (i = 0; i < count; i++)
+        pthread_join(threads[i].thread, NULL);
+    seconds = (now_ns() - start) / 1e9;
+    pthread_barrier_destroy(&start_barrier);
+
+    printf("writers %d readers %d channels %u size %zu%s censorship %d fd %s\n", writers, readers,
+           config->channels, config->size, config->fixed ? " (fixed)" : "", config->censorship,
+           config->reuse_fd ? "reused" : "per-message");
+    report("write", threads, count, 1, seconds);
+    report("read", threads, count, 0, seconds);
+
+    for (i = 0; i < count; i++)
+        free(threads[i].samples);
+    free(threads);
+}
+
+// prefill: Writes one message to every channel so that reads have something to return
+static void prefill(const bench_config_t* config) {
+    char* buffer = malloc(config->size);
+    unsigned int channel;
+    int fd;
+
+    if (!buffer) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buffer, 'p', config->size);
+    fd = open_channel(config, 1, O_WRONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    for (channel = 1; channel <= config->channels; channel++) {
+        if (pwrite(fd, buffer, config->size, channel) < 0) {
+            perror("pwrite");
+            exit(1);
+        }
+    }
+    close(fd);
+    free(buffer);
+}
+
+// curve: Runs the configured benchmark once, or with -S for 1, 2, 4, ... threads per role
+static void curve(const bench_config_t* config) {
+    int max_threads = config->writers > config->readers ? config->writers : config->readers;
+    int threads;
+
+    if (!config->scaling) {
+        run(config, config->writers, config->readers);
+        return;
+    }
+    for (threads = 1;; threads *= 2) {
+        if (threads > max_threads)
+            threads = max_threads;
+        run(config, threads < config->writers ? threads : config->writers,
+            threads < config->readers ? threads : config->readers);
+        if (threads == max_threads)
+            break;
+    }
+}
+
+// mode_run: The configured benchmark, on prefilled channels
+static void mode_run(const bench_config_t* config) {
+    prefill(config);
+    curve(config);
+}
+
+// mode_lookup: Readers alone on 1, 16, 256, ... prefilled channels up to -c, each read
+// naming its channel, so that read latency shows the cost of the channel lookup as the
+// number of channels in the slot grows
+static void mode_lookup(const bench_config_t* config) {
+    bench_config_t sweep = *config;
+    unsigned int channels;
+
+    for (channels = 1;; channels *= 16) {
+        if (channels > config->channels)
+            channels = config->channels;
+        sweep.channels = channels;
+        prefill(&sweep);
+        run(&sweep, 0, sweep.readers);
+        if (channels == config->channels)
+            break;
+    }
+}
+
+// mode_mutex: The scaling curve of the configured benchmark, then the same curve with every
+// transfer serialized on one process-wide mutex, the baseline of a device behind a single
+// global lock, to compare with the device's per-channel writer locking and lock-free reads
+static void mode_mutex(const bench_config_t* config) {
+    bench_config_t baseline = *config;
+
+    baseline.scaling = 1;
+    prefill(config);
+    printf("device:\n");
+    curve(&baseline);
+    printf("global mutex baseline:\n");
+    baseline.serialize = 1;
+    curve(&baseline);
+}
+
+// mode_fanout: One writer fanning out to 1, 8 and 64 readers of the same channels, whose
+// read latency stays flat when reads take no lock and write no shared cacheline
+static void mode_fanout(const bench_config_t* config) {
+    static const int readers[] = { 1, 8, 64 };
+    unsigned int i;
+
+    prefill(config);
+    for (i = 0; i < sizeof(readers) / sizeof(readers[0]); i++)
+        run(config, 1, readers[i]);
+}
+
+// mode_write: Writers alone at message sizes 8, 16, 32, ... up to -s. Inline-sized writes
+// copy straight into a reused or slab-allocated buffer; larger ones show the cost of a
+// kvmalloc per write.
+static void mode_write(const bench_config_t* config) {
+    bench_config_t sweep = *config;
+    size_t size;
+
+    for (size = 8;; size *= 2) {
+        if (size > config->size)
+            size = config->size;
+        sweep.size = size;
+        // -F applies to the sizes that have specialized paths
+        sweep.fixed = config->fixed && (size == 8 || size == 16 || size == 64 || size == 128);
+        run(&sweep, sweep.writers, 0);
+        if (size == config->size)
+            break;
+    }
+}
+
+// Capacity of the channel queues of -m queue
+#define BENCH_QUEUE_CAPACITY 1024
+
+// set_queue: Switches every benchmarked channel to queue mode with the given capacity,
+// or back to overwrite mode for capacity 0
+static void set_queue(const bench_config_t* config, unsigned int capacity) {
+    struct msg_slot_queue_config queue = { .capacity = capacity, .policy = MSG_SLOT_QUEUE_DROP_OLDEST };
+    unsigned int channel;
+    int fd;
+
+    for (channel = 1; channel <= config->channels; channel++) {
+        fd = open_channel(config, channel, O_RDWR);
+        if (fd < 0 || ioctl(fd, MSG_SLOT_SET_QUEUE, &queue) < 0) {
+            perror("MSG_SLOT_SET_QUEUE");
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+// mode_queue: The configured benchmark on overwriting channels, then on the same channels
+// in queue mode, where writes enqueue and reads consume (finding the queue empty when
+// readers outpace writers), then returns the channels to overwrite mode
+static void mode_queue(const bench_config_t* config) {
+    prefill(config);
+    printf("overwrite mode:\n");
+    curve(config);
+    set_queue(config, BENCH_QUEUE_CAPACITY);
+    printf("queue mode, capacity %d, oldest dropped on overflow:\n", BENCH_QUEUE_CAPACITY);
+    curve(config);
+    set_queue(config, 0);
+}
+
+// mode_adjacent: Pinned writers each on their own channel, created one after the other so
+// that the channels are neighbours in the slab, and readers each on one of those channels.
+// Under perf stat -e cache-misses, the misses show whether writers of neighbouring channels,
+// or a channel's readers and writers, share cachelines they do not need to.
+static void mode_adjacent(const bench_config_t* config) {
+    bench_config_t adjacent = *config;
+
+    adjacent.channels = config->writers > 0 ? config->writers : 1;
+    adjacent.stick = 1;
+    adjacent.pin = 1;
+    prefill(&adjacent);
+    run(&adjacent, adjacent.writers, adjacent.readers);
+}
+
+typedef struct {
+    const char* name;
+    void (*fn)(const bench_config_t* config);
+    const char* help;
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+    { "run", mode_run, "the configured run, or scaling curve with -S (default)" },
+    { "lookup", mode_lookup, "read latency on 1, 16, 256, ... channels up to -c (e.g. -c 65536)" },
+    { "mutex", mode_mutex, "scaling curve up to -w/-r, then the same behind one global mutex" },
+    { "fanout", mode_fanout, "one writer and 1, 8, then 64 readers" },
+    { "write", mode_write, "writes/s of writers alone at sizes 8, 16, 32, ... up to -s" },
+    { "queue", mode_queue, "the configured run in overwrite mode, then with queued channels" },
+    { "adjacent", mode_adjacent, "pinned threads each on one of -w neighbouring channels; run it\n"
+                                 "                   under perf stat -e cache-misses,cache-references" },
+};
+
+static void usage(const char* name) {
+    unsigned int i;
+
+    fprintf(stderr,
+            "Usage: %s [options] <device_file>\n"
+            "  -w <n>  writer threads (default 1)\n"
+            "  -r <n>  reader threads (default 1)\n"
+            "  -c <n>  channels, each thread cycling through all of them (default 1)\n"
+            "  -s <n>  message size in bytes (default 64)\n"
+            "  -C      enable censorship\n"
+            "  -o      open, set up and close the device for every message instead of reusing fds\n"
+            "  -p      pin threads to consecutive cores\n"
+            "  -t <n>  seconds per run (default 5)\n"
+            "  -S      scaling curve: repeat with 1, 2, 4, ... threads per role up to -w/-r\n"
+            "  -N <n>  place the slot's channels and messages on NUMA node n (-1: writer's node);\n"
+            "          combine with -p or numactl to compare node-local and remote readers\n"
+            "  -F      declare the -s size fixed (8, 16, 64 or 128) so fds use the specialized paths,\n"
+            "          with one fd per channel; compare with a run without -F\n"
+            "  -m <m>  mode:\n",
+            name);
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        fprintf(stderr, "          %-8s %s\n", modes[i].name, modes[i].help);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    bench_config_t config = {
+        .writers = 1, .readers = 1, .channels = 1, .size = 64, .reuse_fd = 1, .seconds = 5, .node = -2,
+        .mode = "run",
+    };
+    const bench_mode_t* mode = NULL;
+    unsigned int i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:c:s:Copt:SN:Fm:")) != -1) {
+        switch (opt) {
+            case 'w': config.writers = atoi(optarg); break;
+            case 'r': config.readers = atoi(optarg); break;
+            case 'c': config.channels = atoi(optarg); break;
+            case 's': config.size = strtoul(optarg, NULL, 0); break;
+            case 'C': config.censorship = 1; break;
+            case 'o': config.reuse_fd = 0; break;
+            case 'p': config.pin = 1; break;
+            case 't': config.seconds = atoi(optarg); break;
+            case 'S': config.scaling = 1; break;
+            case 'N': config.node = atoi(optarg); break;
+            case 'F': config.fixed = 1; break;
+            case 'm': config.mode = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || config.writers < 0 || config.readers < 0 || config.writers + config.readers == 0 ||
+        config.channels == 0 || config.size == 0 || config.size > MSG_SLOT_MAX_LARGE_LENGTH || config.seconds <= 0) {
+        usage(argv[0]);
+    }
+    // MSG_SLOT_SET_FIXED_SIZE only accepts the sizes with specialized paths
+    if (config.fixed && config.size != 8 && config.size != 16 && config.size != 64 && config.size != 128) {
+        usage(argv[0]);
+    }
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strcmp(modes[i].name, config.mode) == 0)
+            mode = &modes[i];
+    }
+    if (!mode) {
+        usage(argv[0]);
+    }
+    config.device = argv[optind];
+
+    if (config.size > MAX_MESSAGE_LENGTH) {
+        int fd = open_channel(&config, 1, O_WRONLY);
+
+        if (fd < 0 || ioctl(fd, MSG_SLOT_SET_MAX_LEN, (unsigned int) config.size) < 0) {
+            perror("MSG_SLOT_SET_MAX_LEN");
+            return 1;
+        }
+        close(fd);
+    }
+    if (config.node != -2) {
+        int fd = open_channel(&config, 1, O_WRONLY);
+
+        if (fd < 0 || ioctl(fd, MSG_SLOT_SET_NODE, config.node) < 0) {
+            perror("MSG_SLOT_SET_NODE");
+            return 1;
+        }
+        close(fd);
+    }
+    mode->fn(&config);
+    return 0;
+}
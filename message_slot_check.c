@@ -0,0 +1,134 @@
+// message_slot_check: Checks device behaviour not covered by the tools: transfers that move
+// a message without a user-space buffer, and error returns of the batch ioctls.
+// Run against a loaded device node: message_slot_check <device_file> <channel_id>
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "message_slot.h"
+
+#define CHECK_LENGTH 100
+#define CHECK_COUNT  4096
+
+// open_channel: Opens the device with a channel selected, or exits
+static int open_channel(const char* device, unsigned int channel_id) {
+    int fd = open(device, O_RDWR);
+
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    if (ioctl(fd, MSG_SLOT_CHANNEL, channel_id) < 0) {
+        perror("ioctl MSG_SLOT_CHANNEL");
+        exit(1);
+    }
+    return fd;
+}
+
+// check_sendfile: sendfile() from a channel to a socket, with a count larger than the
+// message, must send the message exactly once: the call returns the message's length and
+// the peer receives nothing more. A second sendfile() on the fd sends the message again.
+static int check_sendfile(const char* device, unsigned int channel_id) {
+    char message[CHECK_LENGTH];
+    char received[CHECK_COUNT];
+    ssize_t sent;
+    ssize_t got;
+    int sockets[2];
+    int fd = open_channel(device, channel_id);
+    int round;
+
+    memset(message, 'm', sizeof(message));
+    if (write(fd, message, sizeof(message)) != sizeof(message)) {
+        perror("write");
+        return 1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+
+    for (round = 0; round < 2; round++) {
+        sent = sendfile(sockets[0], fd, NULL, CHECK_COUNT);
+        if (sent != CHECK_LENGTH) {
+            fprintf(stderr, "sendfile: sent %zd bytes, expected %d\n", sent, CHECK_LENGTH);
+            return 1;
+        }
+        got = recv(sockets[1], received, sizeof(received), MSG_DONTWAIT);
+        if (got != CHECK_LENGTH || memcmp(received, message, CHECK_LENGTH) != 0) {
+            fprintf(stderr, "recv: got %zd bytes, expected the %d byte message\n", got, CHECK_LENGTH);
+            return 1;
+        }
+        got = recv(sockets[1], received, sizeof(received), MSG_DONTWAIT);
+        if (got >= 0 || errno != EAGAIN) {
+            fprintf(stderr, "recv: the message was sent more than once\n");
+            return 1;
+        }
+    }
+
+    close(sockets[0]);
+    close(sockets[1]);
+    close(fd);
+    printf("sendfile: ok\n");
+    return 0;
+}
+
+// check_batch_fault: A batch whose entries cannot be read must fail with EFAULT rather
+// than report a count of entries processed
+static int check_batch_fault(const char* device, unsigned int channel_id) {
+    struct msg_slot_batch batch;
+    unsigned long request;
+    void* unmapped;
+    int fd = open_channel(device, channel_id);
+    long rc;
+    int write;
+
+    // An address just unmapped, so that it is certainly not readable
+    unmapped = mmap(NULL, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (unmapped == MAP_FAILED || munmap(unmapped, 4096) < 0) {
+        perror("mmap");
+        return 1;
+    }
+    batch.entries = (uintptr_t) unmapped;
+    batch.count = 1;
+    batch.reserved = 0;
+
+    for (write = 0; write < 2; write++) {
+        request = write ? MSG_SLOT_BATCH_WRITE : MSG_SLOT_BATCH_READ;
+        rc = ioctl(fd, request, &batch);
+        if (rc != -1 || errno != EFAULT) {
+            fprintf(stderr, "batch %s: returned %ld, expected EFAULT\n", write ? "write" : "read", rc);
+            return 1;
+        }
+    }
+
+    close(fd);
+    printf("batch fault: ok\n");
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    unsigned int channel_id;
+    int failed = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <device_file> <channel_id>\n", argv[0]);
+        return 1;
+    }
+    channel_id = atoi(argv[2]);
+    if (channel_id == 0) {
+        fprintf(stderr, "Invalid channel ID.\n");
+        return 1;
+    }
+
+    failed |= check_sendfile(argv[1], channel_id);
+    failed |= check_batch_fault(argv[1], channel_id);
+    return failed;
+}
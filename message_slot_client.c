@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "message_slot.h"
+#include "message_slot_client.h"
+
+// Bytes of queued messages per device after which msgslot_send_later flushes
+#define BATCH_ARENA_BYTES (1 << 20)
+
+// Represents an open device file of a client, with the settings of its fd and its queued writes
+typedef struct {
+    char* path;
+    int fd;
+    int censorship;                         // Censorship mode of the fd
+    unsigned int channel_id;                // Channel selected on the fd, 0 if none
+    struct msg_slot_batch_entry* entries;   // Queued writes; buffer holds an offset into arena
+    unsigned int count;
+    int batch_censorship;                   // Censorship mode of the queued writes
+    char* arena;                            // Copies of the queued messages
+    size_t arena_used;
+    size_t arena_size;
+} device_t;
+
+struct msgslot_client {
+    int flags;
+    device_t* devices;
+    size_t count;
+};
+
+msgslot_client_t* msgslot_client_create(int flags) {
+    msgslot_client_t* client = calloc(1, sizeof(*client));
+
+    if (client)
+        client->flags = flags;
+    return client;
+}
+
+// open_device: Opens a device file with the widest access its permissions allow, so that
+// one fd serves both directions where it can, while nodes only readable or only writable
+// still open for the transfers they permit
+static int open_device(const char* path, int flags) {
+    static const int modes[] = { O_RDWR, O_RDONLY, O_WRONLY };
+    int error = 0;
+    int fd = -1;
+    size_t i;
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        fd = open(path, modes[i] | flags);
+        if (fd >= 0 || (errno != EACCES && errno != EPERM && errno != EROFS))
+            break;
+        if (!error)
+            error = errno;
+    }
+    if (fd < 0 && error)
+        errno = error;
+    return fd;
+}
+
+// get_device: Returns the device of a client for a device file, opening it on first use
+static device_t* get_device(msgslot_client_t* client, const char* path) {
+    device_t* devices;
+    device_t* device;
+    size_t i;
+
+    for (i = 0; i < client->count; i++) {
+        if (strcmp(client->devices[i].path, path) == 0)
+            return &client->devices[i];
+    }
+
+    devices = realloc(client->devices, (client->count + 1) * sizeof(*devices));
+    if (!devices)
+        return NULL;
+    client->devices = devices;
+    device = &devices[client->count];
+    memset(device, 0, sizeof(*device));
+    device->path = strdup(path);
+    if (!device->path)
+        return NULL;
+    device->fd = open_device(path, (client->flags & MSGSLOT_NONBLOCK) ? O_NONBLOCK : 0);
+    if (device->fd < 0) {
+        free(device->path);
+        return NULL;
+    }
+    client->count++;
+    return device;
+}
+
+// set_censorship: Switches the censorship mode of a device's fd, if it differs
+static int set_censorship(device_t* device, int censor) {
+    censor = censor ? 1 : 0;
+    if (device->censorship == censor)
+        return 0;
+    if (ioctl(device->fd, MSG_SLOT_SET_CEN, censor) < 0)
+        return -1;
+    device->censorship = censor;
+    return 0;
+}
+
+// flush_device: Sends the queued writes of a device in one batch
+static int flush_device(device_t* device) {
+    struct msg_slot_batch batch;
+    int error = 0;
+    int done;
+    unsigned int i;
+
+    if (device->count == 0)
+        return 0;
+    for (i = 0; i < device->count; i++)
+        device->entries[i].buffer += (uintptr_t) device->arena;
+    batch.entries = (uintptr_t) device->entries;
+    batch.count = device->count;
+    batch.reserved = 0;
+
+    if (set_censorship(device, device->batch_censorship) < 0) {
+        error = errno;
+    } else {
+        done = ioctl(device->fd, MSG_SLOT_BATCH_WRITE, &batch);
+        if (done < 0) {
+            error = errno;
+        } else {
+            for (i = 0; i < (unsigned int) done && !error; i++) {
+                if (device->entries[i].status < 0)
+                    error = -device->entries[i].status;
+            }
+            if (!error && (unsigned int) done < device->count)
+                error = EFAULT;
+        }
+    }
+
+    device->count = 0;
+    device->arena_used = 0;
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int msgslot_flush(msgslot_client_t* client) {
+    int error = 0;
+    size_t i;
+
+    for (i = 0; i < client->count; i++) {
+        if (flush_device(&client->devices[i]) < 0 && !error)
+            error = errno;
+    }
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void msgslot_client_destroy(msgslot_client_t* client) {
+    size_t i;
+
+    if (!client)
+        return;
+    msgslot_flush(client);
+    for (i = 0; i < client->count; i++) {
+        close(client->devices[i].fd);
+        free(client->devices[i].path);
+        free(client->devices[i].entries);
+        free(client->devices[i].arena);
+    }
+    free(client->devices);
+    free(client);
+}
+
+int msgslot_fd(msgslot_client_t* client, const char* device_path) {
+    device_t* device = get_device(client, device_path);
+
+    return device ? device->fd : -1;
+}
+
+int msgslot_select(msgslot_client_t* client, const char* device_path, unsigned int channel_id) {
+    device_t* device = get_device(client, device_path);
+
+    if (!device)
+        return -1;
+    if (device->channel_id == channel_id)
+        return 0;
+    if (ioctl(device->fd, MSG_SLOT_CHANNEL, channel_id) < 0)
+        return -1;
+    device->channel_id = channel_id;
+    return 0;
+}
+
+ssize_t msgslot_send(msgslot_client_t* client, const char* device_path, unsigned int channel_id, int censor,
+                     const void* message, size_t length) {
+    device_t* device;
+
+    if (channel_id == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    device = get_device(client, device_path);
+    if (!device || set_censorship(device, censor) < 0)
+        return -1;
+    if (device->channel_id == channel_id)
+        return write(device->fd, message, length);
+    return pwrite(device->fd, message, length, channel_id);
+}
+
+ssize_t msgslot_recv(msgslot_client_t* client, const char* device_path, unsigned int channel_id, void* buffer,
+                     size_t length) {
+    device_t* device;
+
+    if (channel_id == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    device = get_device(client, device_path);
+    if (!device)
+        return -1;
+    if (device->channel_id == channel_id)
+        return read(device->fd, buffer, length);
+    return pread(device->fd, buffer, length, channel_id);
+}
+
+int msgslot_send_later(msgslot_client_t* client, const char* device_path, unsigned int channel_id, int censor,
+                       const void* message, size_t length) {
+    struct msg_slot_batch_entry* entry;
+    device_t* device;
+    size_t size;
+    char* arena;
+    int rc = 0;
+
+    if (channel_id == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    device = get_device(client, device_path);
+    if (!device)
+        return -1;
+    censor = censor ? 1 : 0;
+
+    // Flush early if this message cannot join the current batch
+    if (device->count > 0 && (device->batch_censorship != censor || device->count == MSG_SLOT_BATCH_MAX ||
+                              device->arena_used + length > BATCH_ARENA_BYTES)) {
+        rc = flush_device(device);
+    }
+
+    if (!device->entries) {
+        device->entries = malloc(MSG_SLOT_BATCH_MAX * sizeof(*device->entries));
+        if (!device->entries)
+            return -1;
+    }
+    if (device->arena_used + length > device->arena_size) {
+        size = device->arena_used + length > BATCH_ARENA_BYTES ? device->arena_used + length : BATCH_ARENA_BYTES;
+        arena = realloc(device->arena, size);
+        if (!arena)
+            return -1;
+        device->arena = arena;
+        device->arena_size = size;
+    }
+
+    memcpy(device->arena + device->arena_used, message, length);
+    entry = &device->entries[device->count++];
+    entry->channel_id = channel_id;
+    entry->length = (__u32) length;
+    entry->buffer = device->arena_used;   // Turned into a pointer at flush time
+    entry->status = 0;
+    entry->reserved = 0;
+    device->arena_used += length;
+    device->batch_censorship = censor;
+    return rc;
+}
+
+int msgslot_restore(msgslot_client_t* client, const char* device_path, const void* snapshot, size_t length) {
+    struct msg_slot_restore restore;
+    device_t* device = get_device(client, device_path);
+
+    if (!device)
+        return -1;
+    restore.buffer = (uintptr_t) snapshot;
+    restore.length = length;
+    return ioctl(device->fd, MSG_SLOT_RESTORE, &restore);
+}
@@ -0,0 +1,58 @@
+#ifndef MESSAGE_SLOT_CLIENT_H
+#define MESSAGE_SLOT_CLIENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Client library for message_slot devices (libmsgslot.a).
+// A client keeps one fd open per device file it has used and remembers each fd's
+// censorship mode and selected channel, so repeated transfers cost a single syscall:
+// messages are written and read with pwrite()/pread() naming the channel, and ioctls
+// are only issued when a setting actually changes. Writes can also be queued and sent
+// in one MSG_SLOT_BATCH_WRITE per device.
+// Device files are opened read-write, or only for reading or writing if that is all
+// their permissions allow. A client is not thread-safe; use one per thread.
+// Functions return -1 and set errno on failure, like the system calls they wrap.
+
+// Open fds with O_NONBLOCK: empty reads fail with EWOULDBLOCK instead of waiting
+#define MSGSLOT_NONBLOCK 1
+
+typedef struct msgslot_client msgslot_client_t;
+
+// Creates a client with the given MSGSLOT_* flags, or returns NULL
+msgslot_client_t* msgslot_client_create(int flags);
+
+// Sends queued messages, closes every fd and frees the client
+void msgslot_client_destroy(msgslot_client_t* client);
+
+// Returns the fd of a device file, opening it if needed, for use with poll/epoll.
+// The fd reports readable for its selected channel (see msgslot_select).
+int msgslot_fd(msgslot_client_t* client, const char* device);
+
+// Selects the channel whose new messages poll reports, skipping the ioctl if already selected
+int msgslot_select(msgslot_client_t* client, const char* device, unsigned int channel_id);
+
+// Writes a message to a channel, censored if censor is set.
+// Returns the number of bytes written.
+ssize_t msgslot_send(msgslot_client_t* client, const char* device, unsigned int channel_id, int censor,
+                     const void* message, size_t length);
+
+// Reads the last message of a channel into buffer. Returns the message length.
+ssize_t msgslot_recv(msgslot_client_t* client, const char* device, unsigned int channel_id, void* buffer,
+                     size_t length);
+
+// Queues a message for the next msgslot_flush; the message is copied. Queued messages of
+// a device go out in one batch, flushed early when the batch is full or the censorship
+// mode changes. Errors of an early flush are reported here.
+int msgslot_send_later(msgslot_client_t* client, const char* device, unsigned int channel_id, int censor,
+                       const void* message, size_t length);
+
+// Sends every queued message. Returns 0, or -1 with errno set to the error of the first
+// message that failed; the other messages are sent regardless.
+int msgslot_flush(msgslot_client_t* client);
+
+// Restores a snapshot taken from a slot's debugfs snapshot file into the slot of a device.
+// Returns the number of channels restored.
+int msgslot_restore(msgslot_client_t* client, const char* device, const void* snapshot, size_t length);
+
+#endif
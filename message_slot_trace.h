@@ -0,0 +1,112 @@
+// Tracepoints of the message slot device, usable from perf and bpftrace as
+// message_slot:<event>. Every event carries the minor and channel id it applies to.
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM message_slot
+
+#if !defined(MESSAGE_SLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MESSAGE_SLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Entry of a read or write: channel_id is the channel named by the pread/pwrite offset,
+// or the fd's selected channel (0 if none)
+DECLARE_EVENT_CLASS(message_slot_transfer_enter,
+    TP_PROTO(int minor, unsigned int channel_id, size_t length),
+    TP_ARGS(minor, channel_id, length),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, channel_id)
+        __field(size_t, length)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel_id = channel_id;
+        __entry->length = length;
+    ),
+    TP_printk("minor=%d channel=%u length=%zu", __entry->minor, __entry->channel_id, __entry->length)
+);
+
+DEFINE_EVENT(message_slot_transfer_enter, message_slot_read_enter,
+    TP_PROTO(int minor, unsigned int channel_id, size_t length),
+    TP_ARGS(minor, channel_id, length));
+
+DEFINE_EVENT(message_slot_transfer_enter, message_slot_write_enter,
+    TP_PROTO(int minor, unsigned int channel_id, size_t length),
+    TP_ARGS(minor, channel_id, length));
+
+// Exit of a read or write: result is the byte count or negative errno returned
+DECLARE_EVENT_CLASS(message_slot_transfer_exit,
+    TP_PROTO(int minor, unsigned int channel_id, size_t length, long result),
+    TP_ARGS(minor, channel_id, length, result),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, channel_id)
+        __field(size_t, length)
+        __field(long, result)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel_id = channel_id;
+        __entry->length = length;
+        __entry->result = result;
+    ),
+    TP_printk("minor=%d channel=%u length=%zu result=%ld",
+              __entry->minor, __entry->channel_id, __entry->length, __entry->result)
+);
+
+DEFINE_EVENT(message_slot_transfer_exit, message_slot_read_exit,
+    TP_PROTO(int minor, unsigned int channel_id, size_t length, long result),
+    TP_ARGS(minor, channel_id, length, result));
+
+DEFINE_EVENT(message_slot_transfer_exit, message_slot_write_exit,
+    TP_PROTO(int minor, unsigned int channel_id, size_t length, long result),
+    TP_ARGS(minor, channel_id, length, result));
+
+// Entry of an ioctl: channel_id is the fd's selected channel before the command
+TRACE_EVENT(message_slot_ioctl_enter,
+    TP_PROTO(int minor, unsigned int channel_id, unsigned int cmd, unsigned long param),
+    TP_ARGS(minor, channel_id, cmd, param),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, channel_id)
+        __field(unsigned int, cmd)
+        __field(unsigned long, param)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel_id = channel_id;
+        __entry->cmd = cmd;
+        __entry->param = param;
+    ),
+    TP_printk("minor=%d channel=%u cmd=0x%x param=0x%lx",
+              __entry->minor, __entry->channel_id, __entry->cmd, __entry->param)
+);
+
+// Exit of an ioctl: channel_id is the fd's selected channel after the command
+TRACE_EVENT(message_slot_ioctl_exit,
+    TP_PROTO(int minor, unsigned int channel_id, unsigned int cmd, long result),
+    TP_ARGS(minor, channel_id, cmd, result),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned int, channel_id)
+        __field(unsigned int, cmd)
+        __field(long, result)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->channel_id = channel_id;
+        __entry->cmd = cmd;
+        __entry->result = result;
+    ),
+    TP_printk("minor=%d channel=%u cmd=0x%x result=%ld",
+              __entry->minor, __entry->channel_id, __entry->cmd, __entry->result)
+);
+
+#endif // MESSAGE_SLOT_TRACE_H
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE message_slot_trace
+#include <trace/define_trace.h>